@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * bitmap.c : Compressed uid sets (roaring bitmaps) and the SQL functions
+ * handling them.
+ *
+ * A set is a BLOB, all integers being little endian:
+ *
+ *   count  uint32        number of containers
+ *   count x {
+ *     key    uint16      high 16 bits shared by the container values
+ *     unused uint16
+ *     card   uint32      number of values in the container (1 - 65536)
+ *     offset uint32      position of the container payload in the BLOB
+ *   }
+ *   payloads             sorted uint16 array of the low 16 bits if card
+ *                        <= RB_ARRAY_MAX, 65536 bits bitmap otherwise
+ *
+ * Containers are sorted by key.
+ */
+
+#include "functions.h"
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RB_ARRAY_MAX 4096
+#define RB_BITMAP_SIZE 8192
+#define RB_HEADER_SIZE 12
+
+struct rb_container {
+    uint16_t key;
+    uint32_t card;
+    const unsigned char* payload;
+};
+
+static uint16_t read16(const unsigned char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return le16toh(v);
+}
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static void write16(unsigned char* p, uint16_t v) {
+    v = htole16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void write32(unsigned char* p, uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static size_t payload_size(uint32_t card) {
+    return (card > RB_ARRAY_MAX) ? RB_BITMAP_SIZE : card * sizeof(uint16_t);
+}
+
+/*
+ * Check a container holds exactly card values, in increasing order for
+ * arrays.
+ */
+static int rb_check_payload(const unsigned char* payload, uint32_t card) {
+    uint32_t i, bits = 0;
+
+    if(card > RB_ARRAY_MAX) {
+        for(i = 0 ; i < RB_BITMAP_SIZE ; i += sizeof(uint64_t)) {
+            bits += __builtin_popcountll(read64(payload + i));
+        }
+        return bits == card;
+    }
+    for(i = 1 ; i < card ; ++i) {
+        if(read16(payload + (i - 1) * sizeof(uint16_t)) >= read16(payload + i * sizeof(uint16_t))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Check a set is well formed.
+ * @return Number of containers, -1 if malformed.
+ */
+static int rb_check(const unsigned char* rb, int len) {
+    uint32_t count, i;
+
+    if(len < 4) {
+        return -1;
+    }
+    count = read32(rb);
+    if(count > 65536 || 4 + (size_t)count * RB_HEADER_SIZE > len) {
+        return -1;
+    }
+    for(i = 0 ; i < count ; ++i) {
+        const unsigned char* h = rb + 4 + i * RB_HEADER_SIZE;
+        uint32_t card = read32(h + 4), offset = read32(h + 8);
+        if(card == 0 || card > 65536 || offset > len || len - offset < payload_size(card)
+                || (i > 0 && read16(h - RB_HEADER_SIZE) >= read16(h))
+                || !rb_check_payload(rb + offset, card)) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+static void rb_container(const unsigned char* rb, uint32_t i, struct rb_container* c) {
+    const unsigned char* h = rb + 4 + i * RB_HEADER_SIZE;
+    c->key = read16(h);
+    c->card = read32(h + 4);
+    c->payload = rb + read32(h + 8);
+}
+
+/*
+ * Tell if value is in a (checked) set.
+ */
+static int rb_contains(const unsigned char* rb, int count, uint32_t value) {
+    uint16_t key = value >> 16, low = value & 0xffff;
+    struct rb_container c;
+    int first = 0, last = count - 1;
+
+    while(first <= last) {
+        int middle = (first + last) / 2;
+        rb_container(rb, middle, &c);
+        if(c.key < key) {
+            first = middle + 1;
+        } else if(c.key > key) {
+            last = middle - 1;
+        } else if(c.card > RB_ARRAY_MAX) {
+            return (c.payload[low >> 3] >> (low & 7)) & 1;
+        } else {
+            int f = 0, l = c.card - 1;
+            while(f <= l) {
+                int m = (f + l) / 2;
+                uint16_t v = read16(c.payload + m * sizeof(uint16_t));
+                if(v == low) {
+                    return 1;
+                }
+                if(v < low) {
+                    f = m + 1;
+                } else {
+                    l = m - 1;
+                }
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Number of values in a (checked) set.
+ */
+static size_t rb_cardinality(const unsigned char* rb, int count) {
+    size_t total = 0;
+    int i;
+    for(i = 0 ; i < count ; ++i) {
+        total += read32(rb + 4 + i * RB_HEADER_SIZE + 4);
+    }
+    return total;
+}
+
+/*
+ * Iterator over the values of a (checked) set.
+ */
+struct rb_iterator {
+    const unsigned char* rb;
+    int count;
+    int container;          /* current container */
+    uint32_t position;      /* index in an array, bit in a bitmap */
+    struct rb_container c;
+};
+
+static void rb_iterator_init(struct rb_iterator* it, const unsigned char* rb, int count) {
+    it->rb = rb;
+    it->count = count;
+    it->container = 0;
+    it->position = 0;
+    if(count > 0) {
+        rb_container(rb, 0, &it->c);
+    }
+}
+
+/*
+ * Fetch next value.
+ * @return 0 once every value was returned.
+ */
+static int rb_next(struct rb_iterator* it, uint32_t* value) {
+    while(it->container < it->count) {
+        if(it->c.card <= RB_ARRAY_MAX) {
+            if(it->position < it->c.card) {
+                *value = ((uint32_t)it->c.key << 16) | read16(it->c.payload + it->position++ * sizeof(uint16_t));
+                return 1;
+            }
+        } else {
+            /* skip to the next set bit, a 64 bits word at a time */
+            while(it->position < 65536) {
+                uint64_t word = read64(it->c.payload + (it->position >> 6) * sizeof(uint64_t));
+                word &= ~(uint64_t)0 << (it->position & 63);
+                if(word != 0) {
+                    uint32_t low = (it->position & ~63) + __builtin_ctzll(word);
+                    it->position = low + 1;
+                    *value = ((uint32_t)it->c.key << 16) | low;
+                    return 1;
+                }
+                it->position = (it->position & ~63) + 64;
+            }
+        }
+        if(++it->container < it->count) {
+            rb_container(it->rb, it->container, &it->c);
+        }
+        it->position = 0;
+    }
+    return 0;
+}
+
+/*
+ * Build a set from sorted, distinct values.
+ * @param size Will be filled with the set size.
+ * @return The set, to be freed with sqlite3_free, NULL if out of memory.
+ */
+static unsigned char* rb_encode(const uint32_t* values, size_t n, int* size) {
+    size_t i, start, count = 0, total = 4;
+    unsigned char *rb, *h, *payload;
+
+    for(i = 0 ; i < n ; i = start) {
+        for(start = i ; start < n && (values[start] >> 16) == (values[i] >> 16) ; ++start);
+        ++count;
+        total += RB_HEADER_SIZE + payload_size(start - i);
+    }
+    if(total > INT32_MAX || (rb = sqlite3_malloc64(total)) == NULL) {
+        return NULL;
+    }
+
+    write32(rb, count);
+    h = rb + 4;
+    payload = rb + 4 + count * RB_HEADER_SIZE;
+    for(i = 0 ; i < n ; i = start) {
+        uint32_t card;
+        for(start = i ; start < n && (values[start] >> 16) == (values[i] >> 16) ; ++start);
+        card = start - i;
+        write16(h, values[i] >> 16);
+        write16(h + 2, 0);
+        write32(h + 4, card);
+        write32(h + 8, payload - rb);
+        h += RB_HEADER_SIZE;
+        if(card > RB_ARRAY_MAX) {
+            memset(payload, 0, RB_BITMAP_SIZE);
+            for( ; i < start ; ++i) {
+                uint16_t low = values[i] & 0xffff;
+                payload[low >> 3] |= 1 << (low & 7);
+            }
+        } else {
+            for( ; i < start ; ++i) {
+                write16(payload, values[i] & 0xffff);
+                payload += sizeof(uint16_t);
+            }
+            continue;
+        }
+        payload += RB_BITMAP_SIZE;
+    }
+    *size = total;
+    return rb;
+}
+
+/*
+ * Fetch the set argument of a function, NULL standing for the empty set.
+ * @return Number of containers, -1 if an error was reported.
+ */
+static int rb_arg(sqlite3_context* ctx, sqlite3_value* arg, const unsigned char** rb) {
+    int count;
+
+    if(sqlite3_value_type(arg) == SQLITE_NULL) {
+        *rb = NULL;
+        return 0;
+    }
+    *rb = sqlite3_value_blob(arg);
+    count = rb_check(*rb, sqlite3_value_bytes(arg));
+    if(count < 0) {
+        sqlite3_result_error(ctx, "malformed nss_rb bitmap", -1);
+    }
+    return count;
+}
+
+/*
+ * Fetch the value argument of a function.
+ * @return 0 if an error was reported.
+ */
+static int rb_value_arg(sqlite3_context* ctx, sqlite3_value* arg, uint32_t* value) {
+    sqlite3_int64 v = sqlite3_value_int64(arg);
+
+    if(sqlite3_value_numeric_type(arg) != SQLITE_INTEGER || v < 0 || v > UINT32_MAX) {
+        sqlite3_result_error(ctx, "nss_rb values are 32 bits unsigned integers", -1);
+        return 0;
+    }
+    *value = v;
+    return 1;
+}
+
+/*
+ * Return set with value added or removed.
+ */
+static void rb_update(sqlite3_context* ctx, sqlite3_value** argv, int add) {
+    const unsigned char* rb;
+    struct rb_iterator it;
+    uint32_t value, v, *values;
+    unsigned char* result;
+    size_t n = 0;
+    int count, size;
+
+    if((count = rb_arg(ctx, argv[0], &rb)) < 0 || !rb_value_arg(ctx, argv[1], &value)) {
+        return;
+    }
+    if(count > 0 && rb_contains(rb, count, value) == add) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    if(count == 0 && !add) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    values = sqlite3_malloc64((rb_cardinality(rb, count) + 1) * sizeof(uint32_t));
+    if(values == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    rb_iterator_init(&it, rb, count);
+    while(rb_next(&it, &v)) {
+        if(add && v > value && (n == 0 || values[n - 1] < value)) {
+            values[n++] = value;
+        }
+        if(add || v != value) {
+            values[n++] = v;
+        }
+    }
+    if(add && (n == 0 || values[n - 1] < value)) {
+        values[n++] = value;
+    }
+
+    result = rb_encode(values, n, &size);
+    sqlite3_free(values);
+    if(result == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    sqlite3_result_blob(ctx, result, size, sqlite3_free);
+}
+
+/* nss_rb_add(bitmap, value) */
+static void rb_add_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    rb_update(ctx, argv, 1);
+}
+
+/* nss_rb_remove(bitmap, value) */
+static void rb_remove_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    rb_update(ctx, argv, 0);
+}
+
+/* nss_rb_contains(bitmap, value), 0 for a NULL value (e.g. unknown user) */
+static void rb_contains_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    const unsigned char* rb;
+    uint32_t value;
+    int count;
+
+    if(sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_int(ctx, 0);
+        return;
+    }
+    if((count = rb_arg(ctx, argv[0], &rb)) < 0 || !rb_value_arg(ctx, argv[1], &value)) {
+        return;
+    }
+    sqlite3_result_int(ctx, count > 0 && rb_contains(rb, count, value));
+}
+
+/*
+ * nss_rb_build(value) aggregate state.
+ */
+struct rb_build {
+    uint32_t* values;
+    size_t count;
+    size_t size;
+};
+
+static void rb_build_step(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    struct rb_build* b = sqlite3_aggregate_context(ctx, sizeof(*b));
+    uint32_t value;
+
+    if(b == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    if(sqlite3_value_type(argv[0]) == SQLITE_NULL || !rb_value_arg(ctx, argv[0], &value)) {
+        return;
+    }
+    if(b->count == b->size) {
+        size_t size = (b->size == 0) ? 64 : b->size * 2;
+        uint32_t* values = sqlite3_realloc64(b->values, size * sizeof(uint32_t));
+        if(values == NULL) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+        b->values = values;
+        b->size = size;
+    }
+    b->values[b->count++] = value;
+}
+
+static int compare_values(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void rb_build_final(sqlite3_context* ctx) {
+    struct rb_build* b = sqlite3_aggregate_context(ctx, 0);
+    unsigned char* result;
+    size_t i, n = 0;
+    int size;
+
+    if(b == NULL || b->count == 0) {
+        result = rb_encode(NULL, 0, &size);
+    } else {
+        qsort(b->values, b->count, sizeof(uint32_t), compare_values);
+        for(i = 0 ; i < b->count ; ++i) {
+            if(n == 0 || b->values[n - 1] != b->values[i]) {
+                b->values[n++] = b->values[i];
+            }
+        }
+        result = rb_encode(b->values, n, &size);
+    }
+    if(b != NULL) {
+        sqlite3_free(b->values);
+    }
+    if(result == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    sqlite3_result_blob(ctx, result, size, sqlite3_free);
+}
+
+/*
+ * nss_rb_each(bitmap) table valued function, one row per value.
+ */
+#define RB_EACH_VALUE 0
+#define RB_EACH_BITMAP 1
+
+struct rb_each_cursor {
+    sqlite3_vtab_cursor base;
+    unsigned char* rb;          /* private copy of the set */
+    struct rb_iterator it;
+    sqlite3_int64 rowid;
+    uint32_t value;
+    int eof;
+};
+
+static int rb_each_connect(sqlite3* pDb, void* aux, int argc, const char* const* argv,
+                           sqlite3_vtab** ppVtab, char** err) {
+    int res = sqlite3_declare_vtab(pDb, "CREATE TABLE x(value INTEGER, bitmap HIDDEN)");
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    *ppVtab = sqlite3_malloc(sizeof(**ppVtab));
+    if(*ppVtab == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(*ppVtab, 0, sizeof(**ppVtab));
+    sqlite3_vtab_config(pDb, SQLITE_VTAB_INNOCUOUS);
+    return SQLITE_OK;
+}
+
+static int rb_each_disconnect(sqlite3_vtab* pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+static int rb_each_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+    struct rb_each_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if(cur == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int rb_each_close(sqlite3_vtab_cursor* pCursor) {
+    struct rb_each_cursor* cur = (struct rb_each_cursor*)pCursor;
+    sqlite3_free(cur->rb);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int rb_each_next(sqlite3_vtab_cursor* pCursor) {
+    struct rb_each_cursor* cur = (struct rb_each_cursor*)pCursor;
+    cur->eof = !rb_next(&cur->it, &cur->value);
+    cur->rowid++;
+    return SQLITE_OK;
+}
+
+static int rb_each_filter(sqlite3_vtab_cursor* pCursor, int idxNum, const char* idxStr,
+                          int argc, sqlite3_value** argv) {
+    struct rb_each_cursor* cur = (struct rb_each_cursor*)pCursor;
+    int len, count = 0;
+
+    sqlite3_free(cur->rb);
+    cur->rb = NULL;
+    if(argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        len = sqlite3_value_bytes(argv[0]);
+        count = rb_check(sqlite3_value_blob(argv[0]), len);
+        if(count < 0) {
+            pCursor->pVtab->zErrMsg = sqlite3_mprintf("malformed nss_rb bitmap");
+            return SQLITE_ERROR;
+        }
+        /* argv only lives during this call */
+        if((cur->rb = sqlite3_malloc(len)) == NULL) {
+            return SQLITE_NOMEM;
+        }
+        memcpy(cur->rb, sqlite3_value_blob(argv[0]), len);
+    }
+    rb_iterator_init(&cur->it, cur->rb, count);
+    cur->rowid = 0;
+    return rb_each_next(pCursor);
+}
+
+static int rb_each_eof(sqlite3_vtab_cursor* pCursor) {
+    return ((struct rb_each_cursor*)pCursor)->eof;
+}
+
+static int rb_each_column(sqlite3_vtab_cursor* pCursor, sqlite3_context* ctx, int i) {
+    struct rb_each_cursor* cur = (struct rb_each_cursor*)pCursor;
+    if(i == RB_EACH_VALUE) {
+        sqlite3_result_int64(ctx, cur->value);
+    }
+    return SQLITE_OK;
+}
+
+static int rb_each_rowid(sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid) {
+    *pRowid = ((struct rb_each_cursor*)pCursor)->rowid;
+    return SQLITE_OK;
+}
+
+static int rb_each_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info) {
+    int i;
+
+    for(i = 0 ; i < info->nConstraint ; ++i) {
+        if(info->aConstraint[i].iColumn == RB_EACH_BITMAP
+                && info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            if(!info->aConstraint[i].usable) {
+                return SQLITE_CONSTRAINT;
+            }
+            info->aConstraintUsage[i].argvIndex = 1;
+            info->aConstraintUsage[i].omit = 1;
+            info->estimatedCost = 1000;
+            info->estimatedRows = 1000;
+            /* values come out sorted */
+            if(info->nOrderBy == 1 && info->aOrderBy[0].iColumn == RB_EACH_VALUE
+                    && !info->aOrderBy[0].desc) {
+                info->orderByConsumed = 1;
+            }
+            return SQLITE_OK;
+        }
+    }
+    /* no bitmap, no row */
+    info->estimatedCost = 1;
+    info->estimatedRows = 0;
+    return SQLITE_OK;
+}
+
+static sqlite3_module rb_each_module = {
+    0,                          /* iVersion */
+    NULL,                       /* xCreate: eponymous only */
+    rb_each_connect,
+    rb_each_best_index,
+    rb_each_disconnect,
+    NULL,                       /* xDestroy */
+    rb_each_open,
+    rb_each_close,
+    rb_each_filter,
+    rb_each_next,
+    rb_each_eof,
+    rb_each_column,
+    rb_each_rowid,
+};
+
+/*
+ * Register the bitmap functions on a connection.
+ * @param pDb Connection.
+ * @return SQLITE_OK or an SQLite error code.
+ */
+int register_bitmap_functions(struct sqlite3* pDb) {
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+    int res;
+
+    if((res = sqlite3_create_function(pDb, "nss_rb_add", 2, flags, NULL, rb_add_func, NULL, NULL)) != SQLITE_OK
+            || (res = sqlite3_create_function(pDb, "nss_rb_remove", 2, flags, NULL, rb_remove_func, NULL, NULL)) != SQLITE_OK
+            || (res = sqlite3_create_function(pDb, "nss_rb_contains", 2, flags, NULL, rb_contains_func, NULL, NULL)) != SQLITE_OK
+            || (res = sqlite3_create_function(pDb, "nss_rb_build", 1, flags, NULL, NULL, rb_build_step, rb_build_final)) != SQLITE_OK) {
+        return res;
+    }
+    return sqlite3_create_module(pDb, "nss_rb_each", &rb_each_module, NULL);
+}
@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * cache.c : Last known good records, served when the DB can't be read
+ * (locked, missing during an atomic replace, corrupt...).
+ */
+
+#include "nss-sqlite.h"
+#include "cache.h"
+#include "settings.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A cached record. The strings it points to are interned, only gr_mem is
+ * its own.
+ */
+struct cache_entry {
+    int used;
+    enum cache_key_type type;
+    unsigned long id;           /* key for uid/gid lookups */
+    char* name;                 /* key for name lookups, interned */
+    time_t stored;              /* last time the DB confirmed this record */
+    union cache_record {
+        struct passwd pw;
+        struct group gr;
+        struct spwd sp;
+    } data;
+};
+
+/*
+ * String shared by the cached records using it (shells, "x" passwords,
+ * gecos, member names...).
+ */
+struct interned {
+    struct interned* next;      /* in its hash bucket */
+    unsigned long hash;
+    unsigned long refs;
+    size_t len;
+    char text[];
+};
+
+/* Direct mapped table of cache_size entries (see settings), allocated on
+ * first use and again when the setting changes */
+static struct cache_entry* cache = NULL;
+static int cache_entries;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hash table of the interned strings, power of two sized */
+static struct interned** strings = NULL;
+static size_t string_buckets;
+static size_t string_count;
+
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned long hash_string(const char* s) {
+    unsigned long h = 2166136261UL;
+
+    while(*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619UL;
+    }
+    return h;
+}
+
+/*
+ * Double the interned strings table.
+ * @return FALSE if out of memory.
+ */
+static int grow_strings(void) {
+    size_t buckets = (string_buckets > 0) ? string_buckets * 2 : 256;
+    struct interned** grown = calloc(buckets, sizeof(*grown));
+    struct interned* i;
+    size_t b;
+
+    if(grown == NULL) {
+        return FALSE;
+    }
+    for(b = 0 ; b < string_buckets ; ++b) {
+        while((i = strings[b]) != NULL) {
+            strings[b] = i->next;
+            i->next = grown[i->hash & (buckets - 1)];
+            grown[i->hash & (buckets - 1)] = i;
+        }
+    }
+    free(strings);
+    strings = grown;
+    string_buckets = buckets;
+    return TRUE;
+}
+
+/*
+ * Get a shared copy of a string, cache_mutex being held.
+ * @return Copy, NULL if out of memory.
+ */
+static char* intern(const char* s) {
+    unsigned long h = hash_string(s);
+    size_t len = strlen(s);
+    struct interned* i;
+
+    if(string_count >= string_buckets && !grow_strings() && strings == NULL) {
+        return NULL;
+    }
+    for(i = strings[h & (string_buckets - 1)] ; i != NULL ; i = i->next) {
+        if(i->hash == h && i->len == len && memcmp(i->text, s, len) == 0) {
+            i->refs++;
+            nss_stats.intern_saved += len + 1;
+            return i->text;
+        }
+    }
+
+    if((i = malloc(sizeof(*i) + len + 1)) == NULL) {
+        return NULL;
+    }
+    memcpy(i->text, s, len + 1);
+    i->hash = h;
+    i->len = len;
+    i->refs = 1;
+    i->next = strings[h & (string_buckets - 1)];
+    strings[h & (string_buckets - 1)] = i;
+    string_count++;
+    return i->text;
+}
+
+/*
+ * Give back a string obtained from intern, cache_mutex being held.
+ */
+static void unintern(char* text) {
+    struct interned* i;
+    struct interned** link;
+
+    if(text == NULL) {
+        return;
+    }
+    i = (struct interned*)(text - offsetof(struct interned, text));
+    if(--i->refs > 0) {
+        nss_stats.intern_saved -= i->len + 1;
+        return;
+    }
+    for(link = &strings[i->hash & (string_buckets - 1)] ; *link != i ; link = &(*link)->next);
+    *link = i->next;
+    string_count--;
+    free(i);
+}
+
+/*
+ * Give back the strings of a record, which may be partially interned.
+ */
+static void record_release(enum cache_key_type type, union cache_record* r) {
+    char** m;
+
+    switch(type) {
+        case CACHE_PWNAM:
+        case CACHE_PWUID:
+            unintern(r->pw.pw_name);
+            unintern(r->pw.pw_passwd);
+            unintern(r->pw.pw_gecos);
+            unintern(r->pw.pw_dir);
+            unintern(r->pw.pw_shell);
+            break;
+        case CACHE_GRNAM:
+        case CACHE_GRGID:
+            unintern(r->gr.gr_name);
+            unintern(r->gr.gr_passwd);
+            for(m = r->gr.gr_mem ; m != NULL && *m != NULL ; ++m) {
+                unintern(*m);
+            }
+            free(r->gr.gr_mem);
+            break;
+        case CACHE_SPNAM:
+            unintern(r->sp.sp_namp);
+            unintern(r->sp.sp_pwdp);
+            break;
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Copy a record, interning its strings.
+ * @return FALSE if out of memory.
+ */
+static int record_intern(enum cache_key_type type, union cache_record* r, const void* record) {
+    int ok = TRUE;
+    size_t count = 0, i;
+
+    memset(r, 0, sizeof(*r));
+    switch(type) {
+        case CACHE_PWNAM:
+        case CACHE_PWUID: {
+            const struct passwd* pw = record;
+            r->pw.pw_uid = pw->pw_uid;
+            r->pw.pw_gid = pw->pw_gid;
+            ok = (r->pw.pw_name = intern(pw->pw_name)) != NULL
+                && (r->pw.pw_passwd = intern(pw->pw_passwd)) != NULL
+                && (r->pw.pw_gecos = intern(pw->pw_gecos)) != NULL
+                && (r->pw.pw_dir = intern(pw->pw_dir)) != NULL
+                && (r->pw.pw_shell = intern(pw->pw_shell)) != NULL;
+            break;
+        }
+        case CACHE_GRNAM:
+        case CACHE_GRGID: {
+            const struct group* gr = record;
+            while(gr->gr_mem[count] != NULL) {
+                ++count;
+            }
+            r->gr.gr_gid = gr->gr_gid;
+            ok = (r->gr.gr_mem = calloc(count + 1, sizeof(char*))) != NULL
+                && (r->gr.gr_name = intern(gr->gr_name)) != NULL
+                && (r->gr.gr_passwd = intern(gr->gr_passwd)) != NULL;
+            for(i = 0 ; ok && i < count ; ++i) {
+                ok = (r->gr.gr_mem[i] = intern(gr->gr_mem[i])) != NULL;
+            }
+            break;
+        }
+        case CACHE_SPNAM: {
+            const struct spwd* sp = record;
+            r->sp = *sp;
+            r->sp.sp_pwdp = NULL;
+            ok = (r->sp.sp_namp = intern(sp->sp_namp)) != NULL
+                && (r->sp.sp_pwdp = intern(sp->sp_pwdp)) != NULL;
+            break;
+        }
+    }
+    if(!ok) {
+        record_release(type, r);
+    }
+    return ok;
+}
+
+static void release(struct cache_entry* e) {
+    if(e->used) {
+        record_release(e->type, &e->data);
+    }
+    unintern(e->name);
+    e->name = NULL;
+    e->used = 0;
+}
+
+/*
+ * Drop the table and every record in it.
+ */
+static void cache_clear(void) {
+    int i;
+
+    for(i = 0 ; i < cache_entries ; ++i) {
+        release(&cache[i]);
+    }
+    free(cache);
+    cache = NULL;
+}
+
+/*
+ * Find the slot a key maps to (FNV-1a hash).
+ * @return Slot, or NULL if the table can't be allocated.
+ */
+static struct cache_entry* cache_slot(enum cache_key_type type, const char* name, unsigned long id) {
+    const struct nss_settings* s = settings_acquire();
+    int size = s->cache_size;
+    unsigned long h = 2166136261UL ^ type;
+
+    settings_release(s);
+    if(cache != NULL && cache_entries != size) {
+        cache_clear();
+    }
+    if(cache == NULL) {
+        if(size <= 0 || (cache = calloc(size, sizeof(*cache))) == NULL) {
+            return NULL;
+        }
+        cache_entries = size;
+    }
+
+    if(name != NULL) {
+        while(*name) {
+            h = (h ^ (unsigned char)*name++) * 16777619UL;
+        }
+    } else {
+        h = (h ^ id) * 16777619UL;
+    }
+    return &cache[h % cache_entries];
+}
+
+static int same_key(struct cache_entry* e, enum cache_key_type type, const char* name, unsigned long id) {
+    if(!e->used || e->type != type) {
+        return FALSE;
+    }
+    return (name != NULL) ? strcmp(e->name, name) == 0 : e->id == id;
+}
+
+
+static int same_string(const char* a, const char* b) {
+    return strcmp(a, b) == 0;
+}
+
+/*
+ * Compare a cached record with a freshly fetched one.
+ */
+static int same_record(struct cache_entry* e, const void* record) {
+    switch(e->type) {
+        case CACHE_PWNAM:
+        case CACHE_PWUID: {
+            const struct passwd* pw = record;
+            return e->data.pw.pw_uid == pw->pw_uid && e->data.pw.pw_gid == pw->pw_gid
+                && same_string(e->data.pw.pw_name, pw->pw_name)
+                && same_string(e->data.pw.pw_passwd, pw->pw_passwd)
+                && same_string(e->data.pw.pw_gecos, pw->pw_gecos)
+                && same_string(e->data.pw.pw_dir, pw->pw_dir)
+                && same_string(e->data.pw.pw_shell, pw->pw_shell);
+        }
+        case CACHE_GRNAM:
+        case CACHE_GRGID: {
+            const struct group* gr = record;
+            int i;
+            if(e->data.gr.gr_gid != gr->gr_gid
+                    || !same_string(e->data.gr.gr_name, gr->gr_name)
+                    || !same_string(e->data.gr.gr_passwd, gr->gr_passwd)) {
+                return FALSE;
+            }
+            for(i = 0 ; e->data.gr.gr_mem[i] != NULL && gr->gr_mem[i] != NULL ; ++i) {
+                if(!same_string(e->data.gr.gr_mem[i], gr->gr_mem[i])) {
+                    return FALSE;
+                }
+            }
+            return e->data.gr.gr_mem[i] == gr->gr_mem[i];
+        }
+        case CACHE_SPNAM: {
+            const struct spwd* sp = record;
+            return e->data.sp.sp_lstchg == sp->sp_lstchg && e->data.sp.sp_min == sp->sp_min
+                && e->data.sp.sp_max == sp->sp_max && e->data.sp.sp_warn == sp->sp_warn
+                && e->data.sp.sp_inact == sp->sp_inact && e->data.sp.sp_expire == sp->sp_expire
+                && same_string(e->data.sp.sp_namp, sp->sp_namp)
+                && same_string(e->data.sp.sp_pwdp, sp->sp_pwdp);
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Copy a record to a caller supplied buffer.
+ */
+static enum nss_status record_fill(enum cache_key_type type, void* dest, char* buf, size_t buflen,
+                                   const void* record, int* errnop) {
+    switch(type) {
+        case CACHE_PWNAM:
+        case CACHE_PWUID:
+            return fill_passwd(dest, buf, buflen, *(const struct passwd*)record, errnop);
+        case CACHE_GRNAM:
+        case CACHE_GRGID:
+            return fill_group(NULL, dest, buf, buflen, *(const struct group*)record, NULL, errnop);
+        case CACHE_SPNAM:
+            return fill_shadow(dest, buf, buflen, *(const struct spwd*)record, errnop);
+    }
+    return NSS_STATUS_UNAVAIL;
+}
+
+/*
+ * Remember a record the DB just returned.
+ */
+static void cache_store(enum cache_key_type type, const char* name, unsigned long id, const void* record) {
+    struct cache_entry* e;
+
+    pthread_mutex_lock(&cache_mutex);
+    e = cache_slot(type, name, id);
+    if(e == NULL) {
+        pthread_mutex_unlock(&cache_mutex);
+        return;
+    }
+
+    if(!same_key(e, type, name, id) || !same_record(e, record)) {
+        release(e);
+        if((name != NULL && (e->name = intern(name)) == NULL) || !record_intern(type, &e->data, record)) {
+            release(e);
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+        e->type = type;
+        e->id = id;
+        e->used = 1;
+    }
+    e->stored = now();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Forget the record cached for a key the DB no longer knows.
+ */
+static void cache_forget(enum cache_key_type type, const char* name, unsigned long id) {
+    struct cache_entry* e;
+
+    pthread_mutex_lock(&cache_mutex);
+    e = cache_slot(type, name, id);
+    if(e != NULL && same_key(e, type, name, id)) {
+        release(e);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Serve a record from the cache if it was stored less than grace seconds
+ * ago.
+ * @return res if nothing usable is cached.
+ */
+static enum nss_status cache_serve(enum cache_key_type type, const char* name, unsigned long id, int grace,
+                                   enum nss_status res, void* dest, char* buf, size_t buflen, int* errnop) {
+    struct cache_entry* e;
+
+    pthread_mutex_lock(&cache_mutex);
+    e = cache_slot(type, name, id);
+    if(e != NULL && same_key(e, type, name, id) && now() - e->stored <= grace) {
+        res = record_fill(type, dest, buf, buflen, &e->data, errnop);
+        if(res == NSS_STATUS_SUCCESS) {
+            STATS_INC(stale_serves);
+            NSS_DEBUG("cache: DB unusable, serving record cached %ld seconds ago\n", (long)(now() - e->stored));
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return res;
+}
+
+/*
+ * Post process a lookup result: remember successful lookups and fall back
+ * on the last known good record when the DB was busy or unusable.
+ * Answers the DB gave (NOTFOUND, ERANGE) are returned untouched, a
+ * NOTFOUND dropping the record cached for that key.
+ * @param type Kind of lookup.
+ * @param name Looked up name, NULL for uid/gid lookups.
+ * @param id Looked up uid/gid.
+ * @param res Status returned by the DB lookup.
+ * @param dest struct passwd, group or spwd filled by the lookup.
+ * @param buf Buffer holding strings pointed to by dest.
+ * @param buflen Buffer length.
+ * @param errnop Pointer to errno, as filled by the lookup.
+ */
+static enum nss_status cache_result(enum cache_key_type type, const char* name, unsigned long id,
+                                    enum nss_status res, void* dest, char* buf, size_t buflen, int* errnop) {
+    const struct nss_settings* s = settings_acquire();
+    int grace = s->stale_grace;
+
+    settings_release(s);
+    if(grace <= 0) {
+        return res;
+    }
+
+    if(res == NSS_STATUS_SUCCESS) {
+        cache_store(type, name, id, dest);
+        return res;
+    }
+
+    if(res == NSS_STATUS_UNAVAIL || (res == NSS_STATUS_TRYAGAIN && *errnop != ERANGE)) {
+        return cache_serve(type, name, id, grace, res, dest, buf, buflen, errnop);
+    }
+    if(res == NSS_STATUS_NOTFOUND) {
+        cache_forget(type, name, id);
+    }
+    return res;
+}
+
+enum nss_status cache_passwd(enum cache_key_type type, const char* name, unsigned long id, enum nss_status res,
+                             struct passwd* pwbuf, char* buf, size_t buflen, int* errnop) {
+    return cache_result(type, name, id, res, pwbuf, buf, buflen, errnop);
+}
+
+enum nss_status cache_group(enum cache_key_type type, const char* name, unsigned long id, enum nss_status res,
+                            struct group* gbuf, char* buf, size_t buflen, int* errnop) {
+    return cache_result(type, name, id, res, gbuf, buf, buflen, errnop);
+}
+
+enum nss_status cache_shadow(enum cache_key_type type, const char* name, unsigned long id, enum nss_status res,
+                             struct spwd* spbuf, char* buf, size_t buflen, int* errnop) {
+    return cache_result(type, name, id, res, spbuf, buf, buflen, errnop);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_CACHE_H
+#define NSS_SQLITE_CACHE_H
+
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+
+/*
+ * Kind of lookup a cached record answers.
+ */
+enum cache_key_type {
+    CACHE_PWNAM,
+    CACHE_PWUID,
+    CACHE_GRNAM,
+    CACHE_GRGID,
+    CACHE_SPNAM
+};
+
+enum nss_status cache_passwd(enum cache_key_type, const char*, unsigned long, enum nss_status,
+                             struct passwd*, char*, size_t, int*);
+enum nss_status cache_group(enum cache_key_type, const char*, unsigned long, enum nss_status,
+                            struct group*, char*, size_t, int*);
+enum nss_status cache_shadow(enum cache_key_type, const char*, unsigned long, enum nss_status,
+                             struct spwd*, char*, size_t, int*);
+
+#endif
@@ -0,0 +1,17 @@
+-- Optional: store the members of large groups as a compressed bitmap of
+-- their uids instead of user_group rows. A group may use both, but a user
+-- shouldn't be listed in both.
+-- The nss_rb_* functions are provided by the module, and to the programs
+-- writing the DB by the nss_sqlite extension installed along with it:
+--   sqlite3 /etc/passwd.sqlite
+--   .load /lib/libnss-sqlite/nss_sqlite
+--   .read conf/bitmap_groups.sql
+-- Members are then managed with e.g.:
+--   UPDATE group_members SET members = nss_rb_add(members, 1000) WHERE gid = 100;
+--   UPDATE group_members SET members = nss_rb_remove(members, 1000) WHERE gid = 100;
+--   INSERT OR REPLACE INTO group_members SELECT gid, nss_rb_build(uid) FROM user_group WHERE gid = 100;
+
+CREATE TABLE group_members(gid INTEGER PRIMARY KEY, members BLOB NOT NULL);
+
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('get_users', 'SELECT username FROM passwd u INNER JOIN user_group ug ON ug.uid = u.uid WHERE ug.gid = ?1 UNION ALL SELECT u.username FROM nss_rb_each((SELECT members FROM group_members WHERE gid = ?1)) m INNER JOIN passwd u ON u.uid = m.value');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('initgroups_dyn', 'SELECT ug.gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ?1 AND ug.gid != ?2 UNION ALL SELECT gm.gid FROM group_members gm INNER JOIN passwd p ON p.username = ?1 WHERE nss_rb_contains(gm.members, p.uid) AND gm.gid != ?2');
@@ -0,0 +1,36 @@
+-- Optional: look users and groups up by an integer hash of their name
+-- instead of seeking the text indexes. The module binds the hash of the
+-- name it looks for to :hash and the name itself to :name, which is still
+-- compared to rule out collisions.
+-- nss_name_hash is provided by the nss_sqlite extension installed along
+-- with the module:
+--   sqlite3 /etc/passwd.sqlite
+--   .load /lib/libnss-sqlite/nss_sqlite
+--   .read conf/name_hash.sql
+-- The DB must then always be written with the extension loaded.
+-- idx_passwd_username and idx_groupname are no longer used by the default
+-- queries and can be dropped if no other query needs them.
+
+ALTER TABLE passwd ADD COLUMN name_hash INTEGER;
+UPDATE passwd SET name_hash = nss_name_hash(username);
+CREATE INDEX idx_passwd_name_hash ON passwd(name_hash);
+CREATE TRIGGER passwd_name_hash_insert AFTER INSERT ON passwd BEGIN
+    UPDATE passwd SET name_hash = nss_name_hash(NEW.username) WHERE uid = NEW.uid;
+END;
+CREATE TRIGGER passwd_name_hash_update AFTER UPDATE OF username ON passwd BEGIN
+    UPDATE passwd SET name_hash = nss_name_hash(NEW.username) WHERE uid = NEW.uid;
+END;
+
+ALTER TABLE groups ADD COLUMN name_hash INTEGER;
+UPDATE groups SET name_hash = nss_name_hash(groupname);
+CREATE INDEX idx_groups_name_hash ON groups(name_hash);
+CREATE TRIGGER groups_name_hash_insert AFTER INSERT ON groups BEGIN
+    UPDATE groups SET name_hash = nss_name_hash(NEW.groupname) WHERE gid = NEW.gid;
+END;
+CREATE TRIGGER groups_name_hash_update AFTER UPDATE OF groupname ON groups BEGIN
+    UPDATE groups SET name_hash = nss_name_hash(NEW.groupname) WHERE gid = NEW.gid;
+END;
+
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getpwnam_r', 'SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd WHERE name_hash = :hash AND username = :name');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getgrnam_r', 'SELECT gid, groupname, passwd FROM groups WHERE name_hash = :hash AND groupname = :name');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('initgroups_dyn', 'SELECT ug.gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.name_hash = :hash AND p.username = :name AND ug.gid != :gid');
@@ -0,0 +1,52 @@
+-- Optional: nested groups. A group_group(parent, child) row makes members
+-- of child members of parent as well, at any depth. group_closure holds
+-- every (ancestor, descendant) pair along with the number of distinct
+-- paths between them; triggers keep it up to date so that get_users and
+-- initgroups_dyn resolve effective membership with indexed reads.
+-- Apply on top of passwd.sql (it replaces the initgroups_dyn query of
+-- user_gids.sql):
+--   sqlite3 /etc/passwd.sqlite < conf/nested_groups.sql
+-- Edges can't be updated, delete and insert them instead. Cycles are
+-- refused, inserting an existing edge again (even with OR REPLACE)
+-- leaves it as is.
+
+CREATE TABLE group_group(parent INTEGER NOT NULL, child INTEGER NOT NULL, CONSTRAINT pk_group_group PRIMARY KEY(parent, child));
+
+CREATE TABLE group_closure(ancestor INTEGER NOT NULL, descendant INTEGER NOT NULL, paths INTEGER NOT NULL, CONSTRAINT pk_group_closure PRIMARY KEY(ancestor, descendant)) WITHOUT ROWID;
+CREATE INDEX idx_gc_descendant ON group_closure(descendant, ancestor);
+
+CREATE TRIGGER group_group_duplicate BEFORE INSERT ON group_group
+WHEN EXISTS (SELECT 1 FROM group_group WHERE parent = NEW.parent AND child = NEW.child) BEGIN
+    SELECT RAISE(IGNORE);
+END;
+
+CREATE TRIGGER group_closure_check BEFORE INSERT ON group_group
+WHEN NEW.parent = NEW.child OR EXISTS (SELECT 1 FROM group_closure WHERE ancestor = NEW.child AND descendant = NEW.parent) BEGIN
+    SELECT RAISE(ABORT, 'nested groups cycle');
+END;
+
+CREATE TRIGGER group_closure_insert AFTER INSERT ON group_group BEGIN
+    INSERT OR IGNORE INTO group_closure VALUES(NEW.parent, NEW.parent, 1);
+    INSERT OR IGNORE INTO group_closure VALUES(NEW.child, NEW.child, 1);
+    INSERT INTO group_closure
+        SELECT a.ancestor, d.descendant, a.paths * d.paths FROM group_closure a, group_closure d
+        WHERE a.descendant = NEW.parent AND d.ancestor = NEW.child
+        ON CONFLICT(ancestor, descendant) DO UPDATE SET paths = paths + excluded.paths;
+END;
+
+CREATE TRIGGER group_closure_delete AFTER DELETE ON group_group BEGIN
+    UPDATE group_closure SET paths = paths - (
+            SELECT a.paths * d.paths FROM group_closure a, group_closure d
+            WHERE a.ancestor = group_closure.ancestor AND a.descendant = OLD.parent
+                AND d.ancestor = OLD.child AND d.descendant = group_closure.descendant)
+        WHERE ancestor IN (SELECT ancestor FROM group_closure WHERE descendant = OLD.parent)
+            AND descendant IN (SELECT descendant FROM group_closure WHERE ancestor = OLD.child);
+    DELETE FROM group_closure WHERE paths = 0;
+END;
+
+CREATE TRIGGER group_group_update BEFORE UPDATE ON group_group BEGIN
+    SELECT RAISE(ABORT, 'delete and insert nested groups instead');
+END;
+
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('get_users', 'SELECT DISTINCT u.username FROM passwd u INNER JOIN user_group ug ON ug.uid = u.uid WHERE ug.gid IN (SELECT ?1 UNION SELECT descendant FROM group_closure WHERE ancestor = ?1)');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('initgroups_dyn', 'SELECT gid FROM (SELECT ug.gid AS gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ?1 UNION SELECT c.ancestor FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid INNER JOIN group_closure c ON c.descendant = ug.gid WHERE p.username = ?1) WHERE gid != ?2');
@@ -0,0 +1,51 @@
+-- Optional: keep each user and group as a record laid out the way the
+-- module returns it, so that a lookup is a single column read and copy.
+-- nss_pack_passwd and nss_pack_group are provided by the nss_sqlite
+-- extension installed along with the module:
+--   sqlite3 /etc/passwd.sqlite
+--   .load /lib/libnss-sqlite/nss_sqlite
+--   .read conf/packed_records.sql
+-- The DB must then always be written with the extension loaded.
+
+ALTER TABLE passwd ADD COLUMN record BLOB;
+UPDATE passwd SET record = nss_pack_passwd(username, passwd, uid, gid, gecos, homedir, shell);
+CREATE TRIGGER passwd_record_insert AFTER INSERT ON passwd BEGIN
+    UPDATE passwd SET record = nss_pack_passwd(username, passwd, uid, gid, gecos, homedir, shell) WHERE uid = NEW.uid;
+END;
+CREATE TRIGGER passwd_record_update AFTER UPDATE OF username, passwd, uid, gid, gecos, homedir, shell ON passwd BEGIN
+    UPDATE passwd SET record = nss_pack_passwd(username, passwd, uid, gid, gecos, homedir, shell) WHERE uid = NEW.uid;
+END;
+
+ALTER TABLE groups ADD COLUMN record BLOB;
+CREATE VIEW group_records AS SELECT gid, nss_pack_group(gid, groupname, passwd, (SELECT group_concat(u.username) FROM user_group ug INNER JOIN passwd u ON u.uid = ug.uid WHERE ug.gid = groups.gid)) AS record FROM groups;
+UPDATE groups SET record = (SELECT record FROM group_records r WHERE r.gid = groups.gid);
+CREATE TRIGGER groups_record_insert AFTER INSERT ON groups BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = NEW.gid) WHERE gid = NEW.gid;
+END;
+CREATE TRIGGER groups_record_update AFTER UPDATE OF gid, groupname, passwd ON groups BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = NEW.gid) WHERE gid = NEW.gid;
+END;
+CREATE TRIGGER groups_record_ug_insert AFTER INSERT ON user_group BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = NEW.gid) WHERE gid = NEW.gid;
+END;
+CREATE TRIGGER groups_record_ug_delete AFTER DELETE ON user_group BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = OLD.gid) WHERE gid = OLD.gid;
+END;
+CREATE TRIGGER groups_record_ug_update AFTER UPDATE ON user_group BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = OLD.gid) WHERE gid = OLD.gid;
+    UPDATE groups SET record = (SELECT record FROM group_records WHERE gid = NEW.gid) WHERE gid = NEW.gid;
+END;
+CREATE TRIGGER groups_record_user_insert AFTER INSERT ON passwd BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records r WHERE r.gid = groups.gid) WHERE gid IN (SELECT gid FROM user_group WHERE uid = NEW.uid);
+END;
+CREATE TRIGGER groups_record_user_delete AFTER DELETE ON passwd BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records r WHERE r.gid = groups.gid) WHERE gid IN (SELECT gid FROM user_group WHERE uid = OLD.uid);
+END;
+CREATE TRIGGER groups_record_username AFTER UPDATE OF username, uid ON passwd BEGIN
+    UPDATE groups SET record = (SELECT record FROM group_records r WHERE r.gid = groups.gid) WHERE gid IN (SELECT gid FROM user_group WHERE uid IN (OLD.uid, NEW.uid));
+END;
+
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getpwnam_r', 'SELECT record FROM passwd WHERE username = ?');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getpwuid_r', 'SELECT record FROM passwd WHERE uid = ?');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getgrnam_r', 'SELECT record FROM groups WHERE groupname = ?');
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('getgrgid_r', 'SELECT record FROM groups WHERE gid = ?');
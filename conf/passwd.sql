@@ -1,4 +1,6 @@
-CREATE TABLE passwd(uid INTEGER PRIMARY KEY, username TEXT NOT NULL, passwd TEXT NOT NULL, gid INTEGER, gecos TEXT NOT NULL default ',,,', homedir TEXT NOT NULL, shell TEXT NOT NULL);
+-- A NULL homedir or shell is given by the homedir and shell settings of
+-- the module (/home/%u and /bin/sh by default), which keeps rows short.
+CREATE TABLE passwd(uid INTEGER PRIMARY KEY, username TEXT NOT NULL, passwd TEXT NOT NULL, gid INTEGER, gecos TEXT NOT NULL default ',,,', homedir TEXT, shell TEXT);
 CREATE INDEX idx_passwd_username ON passwd(username);
 
 CREATE TABLE user_group(uid INTEGER, gid INTEGER, CONSTRAINT pk_user_groups PRIMARY KEY(uid, gid));
@@ -17,6 +19,13 @@ INSERT INTO nss_queries VALUES("getpwuid_r","SELECT username, passwd, uid, gid,
 INSERT INTO nss_queries VALUES("setgrent",   "SELECT gid, groupname, passwd FROM groups");
 INSERT INTO nss_queries VALUES("getgrnam_r", "SELECT gid, groupname, passwd FROM groups WHERE groupname = ?");
 INSERT INTO nss_queries VALUES("getgrgid_r", "SELECT gid, groupname, passwd FROM groups WHERE gid = ?");
+-- Group queries may return the members as a 4th, comma separated, column
+-- which saves running get_users for each group, e.g.:
+-- INSERT OR REPLACE INTO nss_queries VALUES("getgrnam_r", "SELECT g.gid, g.groupname, g.passwd, (SELECT group_concat(u.username) FROM user_group ug INNER JOIN passwd u ON u.uid = ug.uid WHERE ug.gid = g.gid) FROM groups g WHERE g.groupname = ?");
 
 INSERT INTO nss_queries VALUES("initgroups_dyn", "SELECT ug.gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ? AND ug.gid != ?");
+-- initgroups_dyn may return every group in a single row using the
+-- nss_pack_gids aggregate the module provides (the main gid is then removed
+-- by the module if the query doesn't take it as parameter), e.g.:
+-- INSERT OR REPLACE INTO nss_queries VALUES("initgroups_dyn", "SELECT nss_pack_gids(ug.gid) FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ?");
 INSERT INTO nss_queries VALUES("get_users", "SELECT username FROM passwd u INNER JOIN user_group ug ON ug.uid = u.uid WHERE ug.gid = ?");
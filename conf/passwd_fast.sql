@@ -0,0 +1,16 @@
+-- Optimized variant of passwd.sql: every default query is answered from a
+-- single B-tree. Existing DBs are converted by nss-sqlite-migrate.
+-- passwd and groups stay clustered on uid/gid (rowid), name lookups use
+-- covering indexes; user_group is clustered on (uid, gid) with a covering
+-- (gid, uid) index.
+CREATE TABLE passwd(uid INTEGER PRIMARY KEY, username TEXT NOT NULL, passwd TEXT NOT NULL, gid INTEGER, gecos TEXT NOT NULL default ',,,', homedir TEXT, shell TEXT);
+CREATE INDEX idx_passwd_username_cover ON passwd(username, passwd, uid, gid, gecos, homedir, shell);
+
+CREATE TABLE user_group(uid INTEGER, gid INTEGER, CONSTRAINT pk_user_groups PRIMARY KEY(uid, gid)) WITHOUT ROWID;
+CREATE INDEX idx_ug_gid_uid ON user_group(gid, uid);
+
+CREATE TABLE groups(gid INTEGER PRIMARY KEY, groupname TEXT NOT NULL, passwd TEXT NOT NULL DEFAULT '');
+CREATE INDEX idx_groupname_cover ON groups(groupname, gid, passwd);
+
+-- The queries of passwd.sql are compiled in, add rows to override them
+CREATE TABLE nss_queries(name TEXT PRIMARY KEY, query TEXT NOT NULL);
@@ -0,0 +1,6 @@
+-- Optimized variant of shadow.sql: shadow is clustered on username.
+-- Existing DBs are converted by nss-sqlite-migrate.
+CREATE TABLE shadow (username TEXT PRIMARY KEY, passwd TEXT, lastchange INTEGER default -1, mindays INTEGER default -1, maxdays INTEGER default -1, warn INTEGER default -1, inact INTEGER default -1, expire INTEGER default -1) WITHOUT ROWID;
+
+-- The queries of shadow.sql are compiled in, add rows to override them
+CREATE TABLE nss_queries(name TEXT PRIMARY KEY, query TEXT NOT NULL);
@@ -0,0 +1,21 @@
+-- Optional: split users and groups over several DB files (shards), each
+-- one created with passwd.sql. NSS_SQLITE_PASSWD_DB then only holds the
+-- shard map:
+--   sqlite3 /etc/passwd.sqlite < conf/shards.sql
+-- Lookups by name go to the shard nss_name_shard(name, shard count)
+-- gives, lookups by uid (gid) to the shard whose uid (gid) range holds
+-- it. A user or group must thus be stored in the shard its name maps to,
+-- with a uid or gid within the range of this shard: allocate ids from
+-- the range of the shard the name maps to. nss_name_shard is provided by
+-- the nss_sqlite extension installed along with the module.
+-- The user_group rows of a user go to the shard of the user. Groups
+-- having members in other shards need an inline member list (see
+-- passwd.sql). Enumerations go through the shards in order.
+-- Relative paths are relative to the directory of the shard map, shards
+-- are numbered from 0, and a NULL range means no id lookup goes to the
+-- shard.
+
+CREATE TABLE nss_shards(shard INTEGER PRIMARY KEY, path TEXT NOT NULL, min_uid INTEGER, max_uid INTEGER, min_gid INTEGER, max_gid INTEGER);
+
+INSERT INTO nss_shards VALUES(0, 'passwd-0.sqlite', 100000, 4999999, 100000, 4999999);
+INSERT INTO nss_shards VALUES(1, 'passwd-1.sqlite', 5000000, 9999999, 5000000, 9999999);
@@ -0,0 +1,34 @@
+-- Optional: keep every user's supplementary groups in a single row so that
+-- initgroups_dyn is a primary key read instead of a join on each login.
+-- Apply on top of passwd.sql:
+--   sqlite3 /etc/passwd.sqlite < conf/user_gids.sql
+-- gids is a comma separated list (it's built by triggers, which can't use
+-- the nss_pack_gids function of the module).
+
+CREATE TABLE user_gids(username TEXT PRIMARY KEY, gids TEXT) WITHOUT ROWID;
+
+CREATE TRIGGER user_gids_ug_insert AFTER INSERT ON user_group BEGIN
+    INSERT OR REPLACE INTO user_gids SELECT username, (SELECT group_concat(gid) FROM user_group WHERE uid = NEW.uid) FROM passwd WHERE uid = NEW.uid;
+END;
+CREATE TRIGGER user_gids_ug_delete AFTER DELETE ON user_group BEGIN
+    INSERT OR REPLACE INTO user_gids SELECT username, (SELECT group_concat(gid) FROM user_group WHERE uid = OLD.uid) FROM passwd WHERE uid = OLD.uid;
+END;
+CREATE TRIGGER user_gids_ug_update AFTER UPDATE ON user_group BEGIN
+    INSERT OR REPLACE INTO user_gids SELECT username, (SELECT group_concat(gid) FROM user_group WHERE uid = OLD.uid) FROM passwd WHERE uid = OLD.uid;
+    INSERT OR REPLACE INTO user_gids SELECT username, (SELECT group_concat(gid) FROM user_group WHERE uid = NEW.uid) FROM passwd WHERE uid = NEW.uid;
+END;
+
+CREATE TRIGGER user_gids_pw_insert AFTER INSERT ON passwd BEGIN
+    INSERT OR REPLACE INTO user_gids VALUES(NEW.username, (SELECT group_concat(gid) FROM user_group WHERE uid = NEW.uid));
+END;
+CREATE TRIGGER user_gids_pw_delete AFTER DELETE ON passwd BEGIN
+    DELETE FROM user_gids WHERE username = OLD.username;
+END;
+CREATE TRIGGER user_gids_pw_update AFTER UPDATE OF uid, username ON passwd BEGIN
+    DELETE FROM user_gids WHERE username = OLD.username;
+    INSERT OR REPLACE INTO user_gids VALUES(NEW.username, (SELECT group_concat(gid) FROM user_group WHERE uid = NEW.uid));
+END;
+
+INSERT OR REPLACE INTO user_gids SELECT username, (SELECT group_concat(gid) FROM user_group WHERE uid = passwd.uid) FROM passwd;
+
+INSERT OR REPLACE INTO nss_queries(name, query) VALUES('initgroups_dyn', 'SELECT gids FROM user_gids WHERE username = ?');
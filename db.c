@@ -0,0 +1,1185 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * db.c : Persistent database connections and prepared statements.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "functions.h"
+#include "settings.h"
+#include "stats.h"
+#include "vfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef NSS_SQLITE_REPLICA_DIR
+#define PASSWD_REPLICA NSS_SQLITE_REPLICA_DIR "/passwd.sqlite"
+#else
+#define PASSWD_REPLICA NULL
+#endif
+
+struct nss_db passwd_db = NSS_DB_INIT(NSS_SQLITE_PASSWD_DB, PASSWD_REPLICA);
+struct nss_db shadow_db = NSS_DB_INIT(NSS_SQLITE_SHADOW_DB, NULL);
+
+/*
+ * Shard of a DB, see conf/shards.sql: names hashing to its number and ids
+ * within its ranges are looked up in it.
+ */
+struct nss_shard {
+    struct nss_db* db;
+    sqlite3_int64 min_uid, max_uid;
+    sqlite3_int64 min_gid, max_gid;
+};
+
+/* DBs of every shard and layer seen, never freed since lookups may still
+ * be using them when the shard map is reloaded */
+static struct nss_db** part_dbs;
+static int part_db_count;
+static pthread_mutex_t part_dbs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Close a database connection and forget everything derived from it.
+ */
+static void db_disconnect(struct nss_db* db) {
+    int i;
+
+    for(i = 0 ; i < QUERY_COUNT ; ++i) {
+        sqlite3_finalize(db->stmts[i]);
+        db->stmts[i] = NULL;
+        db->rowid[i] = FALSE;
+        free(db->sql[i]);
+        db->sql[i] = NULL;
+    }
+    free(db->shards);
+    db->shards = NULL;
+    db->shard_count = 0;
+    sqlite3_close(db->pDb);
+    db->pDb = NULL;
+    db->broken = FALSE;
+}
+
+/*
+ * Read nss_queries once. Queries which are absent or identical to the
+ * compiled in ones don't need anything more, the others are remembered.
+ */
+static enum nss_status db_load_queries(struct nss_db* db) {
+    struct sqlite3_stmt* pSt;
+    const char* name;
+    const char* text;
+    int ms, res, i;
+
+    for(i = 0 ; i < QUERY_COUNT ; ++i) {
+        db->deadlines[i] = -1;
+    }
+    if(sqlite3_prepare_v2(db->pDb, "SELECT * FROM nss_queries", -1, &pSt, NULL) != SQLITE_OK) {
+        NSS_DEBUG("%s: no nss_queries table, using compiled in queries\n", db->path);
+        sqlite3_finalize(pSt);
+        return NSS_STATUS_SUCCESS;
+    }
+
+    while((res = sqlite3_step(pSt)) == SQLITE_ROW) {
+        read_query_row(pSt, &name, &text, &ms);
+        for(i = 0 ; i < QUERY_COUNT ; ++i) {
+            if(name != NULL && strcmp(name, query_names[i]) == 0) {
+                break;
+            }
+        }
+        if(i == QUERY_COUNT || text == NULL) {
+            continue;
+        }
+        db->deadlines[i] = ms;
+        if(strcmp(text, default_queries[i]) != 0) {
+            NSS_DEBUG("%s: %s query overridden by nss_queries\n", db->path, query_names[i]);
+            nss_stats.overridden[i] = TRUE;
+            db->sql[i] = strdup(text);
+        }
+    }
+    sqlite3_finalize(pSt);
+
+    if(res != SQLITE_DONE) {
+        NSS_ERROR("%s: unable to read nss_queries: %s\n", db->path, sqlite3_errmsg(db->pDb));
+        return (res == SQLITE_BUSY) ? NSS_STATUS_TRYAGAIN : NSS_STATUS_UNAVAIL;
+    }
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Get the DB of a shard or layer, creating it the first time.
+ * @param path DB file.
+ * @param shard TRUE for a shard, which isn't itself sharded.
+ * @return DB, NULL if out of memory.
+ */
+static struct nss_db* part_db(const char* path, int shard) {
+    struct nss_db* db = NULL;
+    struct nss_db** grown;
+    pthread_mutexattr_t attr;
+    int i;
+
+    pthread_mutex_lock(&part_dbs_mutex);
+    for(i = 0 ; i < part_db_count ; ++i) {
+        if(strcmp(part_dbs[i]->path, path) == 0 && part_dbs[i]->is_shard == shard) {
+            pthread_mutex_unlock(&part_dbs_mutex);
+            return part_dbs[i];
+        }
+    }
+
+    grown = realloc(part_dbs, (part_db_count + 1) * sizeof(*part_dbs));
+    if(grown != NULL) {
+        part_dbs = grown;
+        db = calloc(1, sizeof(*db));
+    }
+    if(db != NULL && (db->path = strdup(path)) == NULL) {
+        free(db);
+        db = NULL;
+    }
+    if(db != NULL) {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&db->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        db->is_shard = shard;
+        part_dbs[part_db_count++] = db;
+    }
+    pthread_mutex_unlock(&part_dbs_mutex);
+    return db;
+}
+
+/*
+ * Read the id range of a shard, an empty one if its bounds are NULL.
+ */
+static void read_shard_range(struct sqlite3_stmt* pSt, int col, sqlite3_int64* min, sqlite3_int64* max) {
+    if(sqlite3_column_type(pSt, col) == SQLITE_NULL || sqlite3_column_type(pSt, col + 1) == SQLITE_NULL) {
+        *min = 1;
+        *max = 0;
+        return;
+    }
+    *min = sqlite3_column_int64(pSt, col);
+    *max = sqlite3_column_int64(pSt, col + 1);
+}
+
+/*
+ * Read the shard map of nss_shards, if any. Relative shard paths are
+ * relative to the directory of the DB.
+ */
+static enum nss_status db_load_shards(struct nss_db* db) {
+    struct sqlite3_stmt* pSt;
+    struct nss_shard* shards = NULL;
+    struct nss_shard* grown;
+    const char* slash = strrchr(db->path, '/');
+    char path[PATH_MAX];
+    int count = 0, res;
+
+    if(db->is_shard) {
+        return NSS_STATUS_SUCCESS;
+    }
+    if(sqlite3_prepare_v2(db->pDb, "SELECT shard, path, min_uid, max_uid, min_gid, max_gid"
+                " FROM nss_shards ORDER BY shard", -1, &pSt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(pSt);
+        return NSS_STATUS_SUCCESS;
+    }
+
+    while((res = sqlite3_step(pSt)) == SQLITE_ROW) {
+        const char* file = (const char*)sqlite3_column_text(pSt, 1);
+
+        if(sqlite3_column_int(pSt, 0) != count || file == NULL) {
+            NSS_ERROR("%s: nss_shards must number its shards from 0 and give their path\n", db->path);
+            res = SQLITE_MISMATCH;
+            break;
+        }
+        if(file[0] == '/' || slash == NULL) {
+            snprintf(path, sizeof(path), "%s", file);
+        } else {
+            snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - db->path), db->path, file);
+        }
+        if((grown = realloc(shards, (count + 1) * sizeof(*shards))) == NULL
+                || (grown[count].db = part_db(path, TRUE)) == NULL) {
+            shards = (grown != NULL) ? grown : shards;
+            res = SQLITE_NOMEM;
+            break;
+        }
+        shards = grown;
+        read_shard_range(pSt, 2, &shards[count].min_uid, &shards[count].max_uid);
+        read_shard_range(pSt, 4, &shards[count].min_gid, &shards[count].max_gid);
+        count++;
+    }
+    sqlite3_finalize(pSt);
+
+    if(res != SQLITE_DONE) {
+        if(res != SQLITE_MISMATCH) {
+            NSS_ERROR("%s: unable to read nss_shards: %s\n", db->path, sqlite3_errstr(res));
+        }
+        free(shards);
+        return NSS_STATUS_UNAVAIL;
+    }
+    NSS_DEBUG("%s: %d shards\n", db->path, count);
+    db->shards = shards;
+    db->shard_count = count;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Queries which, when not overridden, look a row up by a column that
+ * conf/passwd.sql declares INTEGER PRIMARY KEY, along with this column.
+ */
+static const struct {
+    enum nss_query query;
+    const char* table;
+    const char* column;
+    const char* sql;
+} rowid_queries[] = {
+    { QUERY_GETPWUID, "passwd", "uid",
+        "SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd WHERE rowid = ?" },
+    { QUERY_GETGRGID, "groups", "gid",
+        "SELECT gid, groupname, passwd FROM groups WHERE rowid = ?" }
+};
+
+/*
+ * Tell if a column is an alias of its table rowid: the only column of the
+ * primary key of a rowid table, declared INTEGER.
+ */
+static int is_rowid_alias(struct sqlite3* pDb, const char* table, const char* column) {
+    struct sqlite3_stmt* pSt;
+    const char* type;
+    char sql[64];
+    int pk, res;
+
+    if(sqlite3_table_column_metadata(pDb, "main", table, column, &type, NULL, NULL, &pk, NULL) != SQLITE_OK
+            || !pk || sqlite3_stricmp(type, "INTEGER") != 0) {
+        return FALSE;
+    }
+
+    /* A composite primary key makes it an ordinary column */
+    if(sqlite3_prepare_v2(pDb, "SELECT count(*) FROM pragma_table_info(?) WHERE pk > 0",
+                -1, &pSt, NULL) != SQLITE_OK) {
+        return FALSE;
+    }
+    sqlite3_bind_text(pSt, 1, table, -1, SQLITE_STATIC);
+    res = sqlite3_step(pSt) == SQLITE_ROW && sqlite3_column_int(pSt, 0) == 1;
+    sqlite3_finalize(pSt);
+    if(!res) {
+        return FALSE;
+    }
+
+    /* Preparing fails on WITHOUT ROWID tables */
+    snprintf(sql, sizeof(sql), "SELECT rowid FROM %s", table);
+    res = sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) == SQLITE_OK;
+    sqlite3_finalize(pSt);
+    return res;
+}
+
+/*
+ * PRAGMA data_version of a connection, which changes when another
+ * connection commits to the DB (WAL commits included).
+ * @return Version, 0 if it can't be read.
+ */
+static int data_version(struct sqlite3* pDb) {
+    struct sqlite3_stmt* pSt;
+    int version = 0;
+
+    if(sqlite3_prepare_v2(pDb, "PRAGMA data_version", -1, &pSt, NULL) == SQLITE_OK
+            && sqlite3_step(pSt) == SQLITE_ROW) {
+        version = sqlite3_column_int(pSt, 0);
+    }
+    sqlite3_finalize(pSt);
+    return version;
+}
+
+/*
+ * Detect the lookups which can be served by a plain rowid seek.
+ */
+static void db_detect_rowid(struct nss_db* db) {
+    int i;
+
+    for(i = 0 ; i < sizeof(rowid_queries) / sizeof(*rowid_queries) ; ++i) {
+        enum nss_query query = rowid_queries[i].query;
+        db->rowid[query] = db->sql[query] == NULL
+            && is_rowid_alias(db->pDb, rowid_queries[i].table, rowid_queries[i].column);
+        if(db->rowid[query]) {
+            NSS_DEBUG("%s: %s resolved by rowid\n", db->path, query_names[query]);
+        }
+    }
+}
+
+/* Key columns of the tables of enum nss_key_table */
+static const struct {
+    const char* table;
+    const char* name;
+    const char* id;                 /* NULL if the table has no id */
+} key_columns[KEY_TABLES] = {
+    { "passwd", "username", "uid" },
+    { "groups", "groupname", "gid" },
+    { "shadow", "username", NULL }
+};
+
+/*
+ * Tell if a column can be sought: the rowid or the first column of a
+ * full index comparing with memcmp, like lookups do.
+ */
+static int is_indexed(struct sqlite3* pDb, const char* table, const char* column) {
+    struct sqlite3_stmt* pSt;
+    int res;
+
+    if(is_rowid_alias(pDb, table, column)) {
+        return TRUE;
+    }
+    if(sqlite3_prepare_v2(pDb, "SELECT 1 FROM pragma_index_list(?1) l, pragma_index_xinfo(l.name) x"
+                " WHERE l.partial = 0 AND x.seqno = 0 AND x.name = ?2 AND x.coll = 'BINARY'",
+                -1, &pSt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(pSt);
+        return FALSE;
+    }
+    sqlite3_bind_text(pSt, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pSt, 2, column, -1, SQLITE_STATIC);
+    res = sqlite3_step(pSt) == SQLITE_ROW;
+    sqlite3_finalize(pSt);
+    return res;
+}
+
+/*
+ * Learn the first bytes of the names of a table, seeking the first name
+ * greater than the last byte seen: one seek per distinct first byte.
+ */
+static void learn_names(struct sqlite3* pDb, int t, struct nss_keys* keys) {
+    struct sqlite3_stmt* pSt;
+    char sql[128];
+    char key[2] = { 0, 0 };
+    int c, res;
+
+    snprintf(sql, sizeof(sql), "SELECT %s FROM %s WHERE %s >= ? ORDER BY %s LIMIT 1",
+            key_columns[t].name, key_columns[t].table, key_columns[t].name, key_columns[t].name);
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(pSt);
+        return;
+    }
+    for(c = 0 ; c < 256 ; ) {
+        key[0] = c;
+        sqlite3_bind_text(pSt, 1, key, (c > 0) ? 1 : 0, SQLITE_STATIC);
+        res = sqlite3_step(pSt);
+        if(res != SQLITE_ROW || sqlite3_column_type(pSt, 0) != SQLITE_TEXT) {
+            /* names stored as BLOBs sort last and are never equal to
+             * a looked up name */
+            break;
+        }
+        c = *sqlite3_column_text(pSt, 0);
+        keys->first[c / 8] |= 1 << (c % 8);
+        c++;
+        sqlite3_reset(pSt);
+    }
+    sqlite3_finalize(pSt);
+    keys->names = (res == SQLITE_ROW || res == SQLITE_DONE);
+}
+
+/*
+ * Learn the id range of a table.
+ */
+static void learn_ids(struct sqlite3* pDb, int t, struct nss_keys* keys) {
+    struct sqlite3_stmt* pSt;
+    char sql[128];
+
+    snprintf(sql, sizeof(sql), "SELECT min(%s), max(%s) FROM %s",
+            key_columns[t].id, key_columns[t].id, key_columns[t].table);
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) == SQLITE_OK && sqlite3_step(pSt) == SQLITE_ROW) {
+        if(sqlite3_column_type(pSt, 0) == SQLITE_INTEGER && sqlite3_column_type(pSt, 1) == SQLITE_INTEGER) {
+            keys->min = sqlite3_column_int64(pSt, 0);
+            keys->max = sqlite3_column_int64(pSt, 1);
+            keys->ids = TRUE;
+        } else if(sqlite3_column_type(pSt, 0) == SQLITE_NULL) {
+            /* empty table */
+            keys->min = 1;
+            keys->max = 0;
+            keys->ids = TRUE;
+        }
+    }
+    sqlite3_finalize(pSt);
+}
+
+/*
+ * Learn the keys of the tables the DB has, when indexes make it cheap.
+ * Done within a read transaction, along with the data_version they are
+ * valid for (see keys_reject).
+ */
+static void db_learn_keys(struct nss_db* db) {
+    int t;
+
+    memset(db->keys, 0, sizeof(db->keys));
+    if(db->shards != NULL) {
+        return;
+    }
+    sqlite3_exec(db->pDb, "BEGIN", NULL, NULL, NULL);
+    db->keys_version = data_version(db->pDb);
+    for(t = 0 ; t < KEY_TABLES ; ++t) {
+        if(is_indexed(db->pDb, key_columns[t].table, key_columns[t].name)) {
+            learn_names(db->pDb, t, &db->keys[t]);
+        }
+        if(key_columns[t].id != NULL && is_indexed(db->pDb, key_columns[t].table, key_columns[t].id)) {
+            learn_ids(db->pDb, t, &db->keys[t]);
+        }
+        if(db->keys[t].ids) {
+            NSS_DEBUG("%s: %s ids within [%lld, %lld]\n", db->path, key_columns[t].table,
+                    (long long)db->keys[t].min, (long long)db->keys[t].max);
+        }
+    }
+    sqlite3_exec(db->pDb, "COMMIT", NULL, NULL, NULL);
+}
+
+/*
+ * Tell if a name starts with one of the prefixes of a list separated by
+ * spaces or commas, or if there is no list.
+ */
+static int has_prefix(const char* prefixes, const char* name) {
+    size_t len;
+
+    if(prefixes == NULL) {
+        return TRUE;
+    }
+    for(prefixes += strspn(prefixes, " \t,") ; *prefixes != '\0' ; prefixes += strspn(prefixes, " \t,")) {
+        len = strcspn(prefixes, " \t,");
+        if(strncmp(prefixes, name, len) == 0) {
+            return TRUE;
+        }
+        prefixes += len;
+    }
+    return FALSE;
+}
+
+/*
+ * Tell if a lookup is outside of the keys the settings allow.
+ */
+static int settings_reject(enum nss_query query, const char* name, sqlite3_int64 id) {
+    const struct nss_settings* s = settings_acquire();
+    int reject;
+
+    switch(query) {
+        case QUERY_GETPWNAM:
+        case QUERY_INITGROUPS:
+        case QUERY_GETSPNAM:
+            reject = !has_prefix(s->user_prefixes, name);
+            break;
+        case QUERY_GETGRNAM:
+            reject = !has_prefix(s->group_prefixes, name);
+            break;
+        case QUERY_GETPWUID:
+            reject = (s->min_uid >= 0 && id < s->min_uid) || (s->max_uid >= 0 && id > s->max_uid);
+            break;
+        case QUERY_GETGRGID:
+            reject = (s->min_gid >= 0 && id < s->min_gid) || (s->max_gid >= 0 && id > s->max_gid);
+            break;
+        default:
+            reject = FALSE;
+            break;
+    }
+    settings_release(s);
+    return reject;
+}
+
+/*
+ * Tell if a lookup is outside of the learned keys of a table.
+ */
+static int keys_exclude(const struct nss_keys* keys, const char* name, sqlite3_int64 id) {
+    unsigned char c;
+
+    if(name != NULL) {
+        c = *name;
+        return keys->names && !(keys->first[c / 8] & (1 << (c % 8)));
+    }
+    return keys->ids && (id < keys->min || id > keys->max);
+}
+
+/*
+ * Tell if a lookup is outside of the keys learned from db. Before
+ * rejecting one, the keys are checked to still hold: the DB may have been
+ * written (e.g. through its WAL) without being reopened. They are learned
+ * again then, or forgotten while statements are running.
+ * Queries overridden by nss_queries may read other tables, thus are
+ * always run.
+ */
+static int keys_reject(struct nss_db* db, enum nss_query query, const char* name, sqlite3_int64 id) {
+    const struct nss_keys* keys;
+
+    if(db->sql[query] != NULL) {
+        return FALSE;
+    }
+    switch(query) {
+        case QUERY_GETPWNAM:
+        case QUERY_INITGROUPS:
+        case QUERY_GETPWUID:
+            keys = &db->keys[KEYS_PASSWD];
+            break;
+        case QUERY_GETGRNAM:
+        case QUERY_GETGRGID:
+            keys = &db->keys[KEYS_GROUPS];
+            break;
+        case QUERY_GETSPNAM:
+            keys = &db->keys[KEYS_SHADOW];
+            break;
+        default:
+            return FALSE;
+    }
+    if(!keys_exclude(keys, name, id)) {
+        return FALSE;
+    }
+    if(data_version(db->pDb) != db->keys_version) {
+        NSS_DEBUG("%s written since its keys were learned\n", db->path);
+        if(db->depth == 0) {
+            db_learn_keys(db);
+        } else {
+            memset(db->keys, 0, sizeof(db->keys));
+        }
+    }
+    return keys_exclude(keys, name, id);
+}
+
+/*
+ * Tell if a DB is in WAL mode: commits then go to the -wal file and don't
+ * change the DB file until a checkpoint.
+ */
+static int is_wal(struct sqlite3* pDb) {
+    struct sqlite3_stmt* pSt;
+    int res;
+
+    if(sqlite3_prepare_v2(pDb, "PRAGMA journal_mode", -1, &pSt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(pSt);
+        return FALSE;
+    }
+    res = sqlite3_step(pSt) == SQLITE_ROW
+        && sqlite3_stricmp((const char*)sqlite3_column_text(pSt, 0), "wal") == 0;
+    sqlite3_finalize(pSt);
+    return res;
+}
+
+/*
+ * Replace the file connection by an in memory copy of the DB, so that
+ * queries don't do any I/O or locking. The copy is made by SQLite within
+ * a read transaction, thus is consistent even if the DB is being written.
+ * It is refreshed when db_check sees the DB file change, thus WAL DBs
+ * aren't copied.
+ */
+static void db_load_memory(struct nss_db* db) {
+    sqlite3_int64 size;
+    unsigned char* image;
+
+    if(is_wal(db->pDb)) {
+        NSS_DEBUG("%s: in WAL mode, not copied in memory\n", db->path);
+        return;
+    }
+    image = sqlite3_serialize(db->pDb, "main", &size, 0);
+    if(image == NULL) {
+        NSS_DEBUG("%s: unable to copy it in memory\n", db->path);
+        return;
+    }
+    if(sqlite3_deserialize(db->pDb, "main", image, size, size,
+                SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_READONLY) != SQLITE_OK) {
+        /* the connection was detached from the file, start over */
+        NSS_ERROR("%s: unable to load it in memory: %s\n", db->path, sqlite3_errmsg(db->pDb));
+        db->broken = TRUE;
+        return;
+    }
+    STATS_INC(memory_loads);
+}
+
+#ifdef NSS_SQLITE_REPLICA_DIR
+/*
+ * Last modification of a DB, which is written through its -wal file in
+ * WAL mode.
+ */
+static struct timespec source_mtime(const char* path, const struct stat* st) {
+    char wal[PATH_MAX];
+    struct stat wst;
+
+    snprintf(wal, sizeof(wal), "%s-wal", path);
+    if(stat(wal, &wst) == 0 && (wst.st_mtim.tv_sec > st->st_mtim.tv_sec
+                || (wst.st_mtim.tv_sec == st->st_mtim.tv_sec && wst.st_mtim.tv_nsec > st->st_mtim.tv_nsec))) {
+        return wst.st_mtim;
+    }
+    return st->st_mtim;
+}
+
+/*
+ * Stat a replica file or directory (without following symbolic links)
+ * and tell if it can be trusted: of the expected type, owned by root or by
+ * the owner of the source and not writable by group nor others.
+ */
+static int replica_stat(const char* path, const struct stat* source, mode_t type, struct stat* st) {
+    return lstat(path, st) == 0 && (st->st_mode & S_IFMT) == type
+        && (st->st_uid == 0 || (source != NULL && st->st_uid == source->st_uid))
+        && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/*
+ * Tell if the replica of db and its directory can be trusted.
+ */
+static int replica_trusted(const struct nss_db* db, const struct stat* source, struct stat* st) {
+    return replica_stat(NSS_SQLITE_REPLICA_DIR, source, S_IFDIR, st)
+        && replica_stat(db->replica, source, S_IFREG, st);
+}
+
+/*
+ * Copy the source DB in a temporary file renamed over the replica. The
+ * copy is made by the backup API, thus is consistent even if the source
+ * is being written. The replica gets the mode of the source (less write
+ * access for group and others) and its modification time, which tells
+ * other processes it is up to date.
+ * @return TRUE if the replica was written.
+ */
+static int db_copy_replica(struct nss_db* db, const struct stat* st, struct timespec mtime) {
+    /* the copy is read without write access, thus can't be in WAL mode */
+    static const unsigned char legacy[2] = { 1, 1 };
+    struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+    char tmp[PATH_MAX];
+    struct sqlite3* pDest;
+    struct sqlite3_backup* pBackup;
+    struct stat dst;
+    int fd, res;
+
+    if(geteuid() == 0 || geteuid() == st->st_uid) {
+        mkdir(NSS_SQLITE_REPLICA_DIR, 0755);
+    }
+    if(!replica_stat(NSS_SQLITE_REPLICA_DIR, st, S_IFDIR, &dst)) {
+        NSS_DEBUG("%s: %s can't be trusted\n", db->path, NSS_SQLITE_REPLICA_DIR);
+        return FALSE;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", db->replica);
+    if((fd = mkstemp(tmp)) < 0) {
+        NSS_DEBUG("%s: unable to create a replica: %s\n", db->path, strerror(errno));
+        return FALSE;
+    }
+
+    res = sqlite3_open_v2(tmp, &pDest, SQLITE_OPEN_READWRITE, NULL);
+    if(res == SQLITE_OK) {
+        sqlite3_exec(pDest, "PRAGMA journal_mode = OFF", NULL, NULL, NULL);
+        pBackup = sqlite3_backup_init(pDest, "main", db->pSource, "main");
+        if(pBackup != NULL) {
+            sqlite3_backup_step(pBackup, -1);
+            res = sqlite3_backup_finish(pBackup);
+        } else {
+            res = sqlite3_errcode(pDest);
+        }
+        if(res != SQLITE_OK) {
+            NSS_ERROR("%s: unable to copy it to %s: %s\n", db->path, db->replica, sqlite3_errmsg(pDest));
+        }
+    }
+    sqlite3_close(pDest);
+
+    if(res != SQLITE_OK || pwrite(fd, legacy, sizeof(legacy), 18) != sizeof(legacy)
+            || fchmod(fd, st->st_mode & 0755) != 0 || futimens(fd, times) != 0
+            || close(fd) != 0 || rename(tmp, db->replica) != 0) {
+        if(res == SQLITE_OK) {
+            NSS_ERROR("%s: unable to write %s: %s\n", db->path, db->replica, strerror(errno));
+        }
+        close(fd);
+        unlink(tmp);
+        return FALSE;
+    }
+    NSS_DEBUG("%s: replica %s refreshed\n", db->path, db->replica);
+    STATS_INC(replica_copies);
+    return TRUE;
+}
+
+/*
+ * Pick the file lookups are served from. The source is checked at most
+ * once every NSS_SQLITE_REPLICA_INTERVAL seconds and the replica copied
+ * again when the source modification time or data_version changed. The
+ * source itself is used until an up to date replica exists (e.g. if the
+ * process can't write NSS_SQLITE_REPLICA_DIR), a stale replica while the
+ * source can't be used.
+ */
+static const char* db_serving_path(struct nss_db* db) {
+    struct timespec now, mtime;
+    struct stat st, rst;
+    int version = 0, opened = FALSE, found, fresh;
+
+    if(db->replica == NULL) {
+        return db->path;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(db->serving != NULL && db->source_pid == getpid()
+            && now.tv_sec < db->replica_checked + NSS_SQLITE_REPLICA_INTERVAL) {
+        return db->serving;
+    }
+    db->replica_checked = now.tv_sec;
+
+    if(db->pSource != NULL && db->source_pid != getpid()) {
+        sqlite3_close(db->pSource);
+        db->pSource = NULL;
+    }
+    db->source_pid = getpid();
+
+    found = (stat(db->path, &st) == 0);
+    if(found && db->pSource == NULL) {
+        /* data_version can only be compared on a given connection */
+        opened = TRUE;
+        open_db(db->path, &db->pSource);
+    }
+    if(!found || db->pSource == NULL) {
+        db->serving = replica_trusted(db, found ? &st : NULL, &rst) ? db->replica : db->path;
+        return db->serving;
+    }
+
+    version = data_version(db->pSource);
+
+    mtime = source_mtime(db->path, &st);
+    fresh = replica_trusted(db, &st, &rst) && rst.st_mtim.tv_sec == mtime.tv_sec
+        && rst.st_mtim.tv_nsec == mtime.tv_nsec && (opened || version == db->data_version);
+    if(!fresh) {
+        fresh = db_copy_replica(db, &st, mtime);
+    }
+    db->data_version = version;
+    db->serving = fresh ? db->replica : db->path;
+    return db->serving;
+}
+#endif
+
+/*
+ * Make sure db has a usable connection: (re)open it the first time, after
+ * a fork, after an error or when the file was changed or replaced.
+ */
+static enum nss_status db_check(struct nss_db* db) {
+    const struct nss_settings* s = settings_acquire();
+    const char* path = db->path;
+    unsigned generation = s->generation;
+    sqlite3_int64 memory_max = s->memory_max;
+    struct stat st;
+    int res;
+
+    settings_release(s);
+    if(db->pDb != NULL && (db->broken || db->pid != getpid() || db->generation != generation)) {
+        db_disconnect(db);
+    }
+
+#ifdef NSS_SQLITE_REPLICA_DIR
+    path = db_serving_path(db);
+#endif
+    if(stat(path, &st) == 0) {
+        int changed = FALSE;
+        if(db->pDb != NULL) {
+            /* generation stamp of the mmap VFS */
+            sqlite3_file_control(db->pDb, "main", NSS_FCNTL_CHANGED, &changed);
+        }
+        if(db->pDb != NULL && (changed || st.st_dev != db->st.st_dev || st.st_ino != db->st.st_ino
+                    || st.st_mtim.tv_sec != db->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != db->st.st_mtim.tv_nsec
+                    || st.st_size != db->st.st_size)) {
+            NSS_DEBUG("%s changed, reopening it\n", db->path);
+            db_disconnect(db);
+        }
+    } else if(db->pDb != NULL) {
+        /* Being replaced, keep on using the file we have */
+        return NSS_STATUS_SUCCESS;
+    } else {
+        memset(&st, 0, sizeof(st));
+    }
+
+    if(db->pDb != NULL) {
+        return NSS_STATUS_SUCCESS;
+    }
+
+    if(open_db(path, &db->pDb) != SQLITE_OK) {
+        return NSS_STATUS_UNAVAIL;
+    }
+    db->pid = getpid();
+    db->st = st;
+    db->generation = generation;
+
+    if(st.st_size > 0 && st.st_size <= memory_max) {
+        db_load_memory(db);
+        if(db->broken) {
+            db_disconnect(db);
+            return NSS_STATUS_UNAVAIL;
+        }
+    }
+
+    res = db_load_queries(db);
+    if(res == NSS_STATUS_SUCCESS) {
+        res = db_load_shards(db);
+    }
+    if(res != NSS_STATUS_SUCCESS) {
+        db_disconnect(db);
+        return res;
+    }
+    db_detect_rowid(db);
+    db_learn_keys(db);
+    return res;
+}
+
+/*
+ * Second half of db_acquire, db being locked and checked. Unlocks it on
+ * failure.
+ */
+static enum nss_status db_prepare(struct nss_db* db, enum nss_query query, struct sqlite3_stmt** ppSt) {
+    const char* sql;
+    int i;
+
+    if(db->stmts[query] == NULL) {
+        sql = (db->sql[query] != NULL) ? db->sql[query] : default_queries[query];
+        if(db->rowid[query]) {
+            for(i = 0 ; rowid_queries[i].query != query ; ++i);
+            sql = rowid_queries[i].sql;
+        }
+        if(sqlite3_prepare_v3(db->pDb, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                    &db->stmts[query], NULL) != SQLITE_OK) {
+            NSS_ERROR("%s: unable to prepare %s query: %s\n", db->path, query_names[query],
+                    sqlite3_errmsg(db->pDb));
+            sqlite3_finalize(db->stmts[query]);
+            db->stmts[query] = NULL;
+            pthread_mutex_unlock(&db->mutex);
+            return NSS_STATUS_UNAVAIL;
+        }
+    }
+
+    if(db->depth > 0) {
+        /* run within another statement (e.g. get_users), whose deadline
+         * db_release restores */
+        deadline_save(&db->outer[query]);
+    }
+    db->depth++;
+    /* A single rowid seek doesn't need to be watched */
+    if(db->rowid[query]) {
+        deadline_stop(db->pDb);
+    } else {
+        deadline_start(db->pDb, query, db->deadlines[query]);
+    }
+    *ppSt = db->stmts[query];
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Get the prepared statement of a query, ready to be bound. The database
+ * stays locked until db_release is called; statements can be acquired
+ * while another one is, as long as they are released in reverse order.
+ * @param db Database.
+ * @param query Wanted query.
+ * @param ppSt Will point to the statement.
+ */
+enum nss_status db_acquire(struct nss_db* db, enum nss_query query, struct sqlite3_stmt** ppSt) {
+    int res;
+
+    pthread_mutex_lock(&db->mutex);
+    if(db->depth == 0) {
+        res = db_check(db);
+        if(res != NSS_STATUS_SUCCESS) {
+            pthread_mutex_unlock(&db->mutex);
+            return res;
+        }
+    }
+    return db_prepare(db, query, ppSt);
+}
+
+/*
+ * Same as db_acquire for a lookup by name or id, which goes to the shard
+ * holding the entry if the DB is sharded. Keys outside of the ones the
+ * settings allow or the DB holds aren't looked up.
+ * @param ppDb DB, will point to the shard queried.
+ * @param query Wanted query.
+ * @param name Name looked up, routed by its hash...
+ * @param id ... or uid (passwd queries) or gid (group queries) looked up,
+ * routed by the shard id ranges.
+ * @param ppSt Will point to the statement.
+ * @return NSS_STATUS_NOTFOUND if no shard or no key of the DB can match
+ * the entry, otherwise as db_acquire.
+ */
+enum nss_status db_acquire_key(struct nss_db** ppDb, enum nss_query query, const char* name, sqlite3_int64 id,
+                               struct sqlite3_stmt** ppSt) {
+    struct nss_db* db = *ppDb;
+    struct nss_db* shard = NULL;
+    int res, i;
+
+    if(settings_reject(query, name, id)) {
+        STATS_INC(key_rejects);
+        return NSS_STATUS_NOTFOUND;
+    }
+
+    pthread_mutex_lock(&db->mutex);
+    if(db->depth == 0) {
+        res = db_check(db);
+        if(res != NSS_STATUS_SUCCESS) {
+            pthread_mutex_unlock(&db->mutex);
+            return res;
+        }
+    }
+    if(db->shards == NULL && keys_reject(db, query, name, id)) {
+        pthread_mutex_unlock(&db->mutex);
+        STATS_INC(key_rejects);
+        return NSS_STATUS_NOTFOUND;
+    }
+    if(db->shards == NULL) {
+        return db_prepare(db, query, ppSt);
+    }
+
+    if(name != NULL) {
+        shard = db->shards[(sqlite3_uint64)name_hash(name) % db->shard_count].db;
+    } else {
+        for(i = 0 ; i < db->shard_count && shard == NULL ; ++i) {
+            const struct nss_shard* s = &db->shards[i];
+            if(query == QUERY_GETGRGID ? (id >= s->min_gid && id <= s->max_gid)
+                    : (id >= s->min_uid && id <= s->max_uid)) {
+                shard = s->db;
+            }
+        }
+    }
+    pthread_mutex_unlock(&db->mutex);
+
+    if(shard == NULL) {
+        NSS_DEBUG("%s: no shard holds #%lld\n", db->path, (long long)id);
+        return NSS_STATUS_NOTFOUND;
+    }
+    *ppDb = shard;
+    return db_acquire_key(ppDb, query, name, id, ppSt);
+}
+
+/*
+ * Get the DB of a shard, for enumerations.
+ * @param db DB.
+ * @param i Shard number, the DB itself being shard 0 if it isn't sharded.
+ * @param ppShard Will point to the shard DB.
+ * @return NSS_STATUS_NOTFOUND past the last shard.
+ */
+enum nss_status db_shard(struct nss_db* db, int i, struct nss_db** ppShard) {
+    int res = NSS_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&db->mutex);
+    if(db->depth == 0) {
+        res = db_check(db);
+    }
+    if(res == NSS_STATUS_SUCCESS) {
+        if(db->shards != NULL) {
+            res = (i < db->shard_count) ? NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND;
+            *ppShard = (i < db->shard_count) ? db->shards[i].db : NULL;
+        } else {
+            res = (i == 0) ? NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND;
+            *ppShard = (i == 0) ? db : NULL;
+        }
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return res;
+}
+
+/*
+ * Split a colon separated path in layers.
+ */
+static enum nss_status db_load_layers(struct nss_db* db) {
+    struct nss_db** layers = NULL;
+    struct nss_db** grown;
+    const char* p = db->path;
+    char path[PATH_MAX];
+    int count = 0;
+
+    while(*p != '\0') {
+        size_t len = strcspn(p, ":");
+        if(len > 0) {
+            snprintf(path, sizeof(path), "%.*s", (int)len, p);
+            if((grown = realloc(layers, (count + 1) * sizeof(*layers))) == NULL) {
+                free(layers);
+                return NSS_STATUS_UNAVAIL;
+            }
+            layers = grown;
+            if((layers[count++] = part_db(path, FALSE)) == NULL) {
+                free(layers);
+                return NSS_STATUS_UNAVAIL;
+            }
+        }
+        p += len + (p[len] == ':');
+    }
+    db->layers = layers;
+    db->layer_count = count;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Get a layer of a DB whose path lists several files separated by colons,
+ * the first ones overriding the next ones. Each layer has its own
+ * connection, thus a change in a layer doesn't invalidate the others.
+ * @param db DB.
+ * @param i Layer number, the DB itself being layer 0 if its path is a
+ * single file.
+ * @param ppLayer Will point to the layer DB.
+ * @return NSS_STATUS_NOTFOUND past the last layer.
+ */
+enum nss_status db_layer(struct nss_db* db, int i, struct nss_db** ppLayer) {
+    int res = NSS_STATUS_SUCCESS;
+
+    /* every lookup and enumeration starts here */
+    settings_check();
+    if(strchr(db->path, ':') == NULL) {
+        *ppLayer = (i == 0) ? db : NULL;
+        return (i == 0) ? NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND;
+    }
+
+    pthread_mutex_lock(&db->mutex);
+    if(db->layers == NULL) {
+        res = db_load_layers(db);
+    }
+    if(res == NSS_STATUS_SUCCESS) {
+        res = (i < db->layer_count) ? NSS_STATUS_SUCCESS : NSS_STATUS_NOTFOUND;
+        *ppLayer = (i < db->layer_count) ? db->layers[i] : NULL;
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return res;
+}
+
+/*
+ * Point a DB to the file(s) given by the settings. Its layers are split
+ * again, the layer DBs themselves stay around.
+ */
+static void db_set_path(struct nss_db* db, const char* path) {
+    pthread_mutex_lock(&db->mutex);
+    if(strcmp(db->path, path) != 0) {
+        NSS_DEBUG("%s now used instead of %s\n", path, db->path);
+        db->path = path;
+        free(db->layers);
+        db->layers = NULL;
+        db->layer_count = 0;
+        sqlite3_close(db->pSource);
+        db->pSource = NULL;
+        db->serving = NULL;
+    }
+    pthread_mutex_unlock(&db->mutex);
+}
+
+/*
+ * Take new settings into account. Connections opened with the previous
+ * ones are reopened the next time they are used (see db_check).
+ */
+void db_configure(void) {
+    const struct nss_settings* s = settings_acquire();
+
+    /* kept for the process life by the settings */
+    db_set_path(&passwd_db, s->passwd_db);
+    db_set_path(&shadow_db, s->shadow_db);
+    settings_release(s);
+}
+
+/*
+ * Get the DB holding a part of the entries, for enumerations: shards of
+ * layers, in order.
+ * @param db DB.
+ * @param layer Layer number, updated when shard is past the last shard
+ * of this layer...
+ * @param shard ... shard number, then reset.
+ * @param ppPart Will point to the part DB.
+ * @return NSS_STATUS_NOTFOUND past the last part.
+ */
+enum nss_status db_part(struct nss_db* db, int* layer, int* shard, struct nss_db** ppPart) {
+    struct nss_db* pLayer;
+    int res;
+
+    while((res = db_layer(db, *layer, &pLayer)) == NSS_STATUS_SUCCESS) {
+        res = db_shard(pLayer, *shard, ppPart);
+        if(res != NSS_STATUS_NOTFOUND) {
+            return res;
+        }
+        ++*layer;
+        *shard = 0;
+    }
+    return res;
+}
+
+/*
+ * Tell if a layer before the given one has an entry for a name, in which
+ * case enumerations skip the entry of this layer.
+ * @param db DB.
+ * @param layer Layer of the entry.
+ * @param query Lookup by name of the entry kind.
+ * @param name Entry name.
+ */
+int db_shadowed(struct nss_db* db, int layer, enum nss_query query, const char* name) {
+    struct nss_db* pLayer;
+    struct sqlite3_stmt* pSt;
+    int found = FALSE, i;
+
+    for(i = 0 ; i < layer && !found && db_layer(db, i, &pLayer) == NSS_STATUS_SUCCESS ; ++i) {
+        if(db_acquire_key(&pLayer, query, name, 0, &pSt) != NSS_STATUS_SUCCESS) {
+            continue;
+        }
+        found = db_bind_name(pSt, name) == SQLITE_OK && db_step(pLayer, pSt) == NSS_STATUS_SUCCESS;
+        db_release(pLayer, pSt);
+    }
+    return found;
+}
+
+/*
+ * Step an acquired statement.
+ * @return NSS_STATUS_SUCCESS if a row is available, NSS_STATUS_NOTFOUND
+ * when there is none left, NSS_STATUS_TRYAGAIN or NSS_STATUS_UNAVAIL if
+ * something went wrong.
+ */
+enum nss_status db_step(struct nss_db* db, struct sqlite3_stmt* pSt) {
+    switch(sqlite3_step(pSt)) {
+        case SQLITE_ROW:
+            return NSS_STATUS_SUCCESS;
+
+        case SQLITE_DONE:
+            return NSS_STATUS_NOTFOUND;
+
+        /* Something was wrong with locks, try again later. */
+        case SQLITE_BUSY:
+            return NSS_STATUS_TRYAGAIN;
+
+        /* Aborted by its deadline, the connection is fine */
+        case SQLITE_INTERRUPT:
+            return NSS_STATUS_UNAVAIL;
+
+        default:
+            NSS_ERROR("%s: %s\n", db->path, sqlite3_errmsg(db->pDb));
+            db->broken = TRUE;
+            return NSS_STATUS_UNAVAIL;
+    }
+}
+
+/*
+ * Give back a statement obtained through db_acquire.
+ */
+void db_release(struct nss_db* db, struct sqlite3_stmt* pSt) {
+    int i;
+
+    sqlite3_reset(pSt);
+    sqlite3_clear_bindings(pSt);
+    if(--db->depth > 0) {
+        for(i = 0 ; i < QUERY_COUNT && db->stmts[i] != pSt ; ++i);
+        if(i < QUERY_COUNT) {
+            deadline_restore(db->pDb, &db->outer[i]);
+        }
+    } else if(db->broken) {
+        db_disconnect(db);
+    }
+    pthread_mutex_unlock(&db->mutex);
+}
+
+/*
+ * Bind the name a query looks for: to :name if the query uses it, to its
+ * first parameter otherwise. Queries seeking a hash column get the name
+ * hash bound to :hash.
+ * @return SQLITE_OK or an SQLite error code.
+ */
+int db_bind_name(struct sqlite3_stmt* pSt, const char* name) {
+    int i = sqlite3_bind_parameter_index(pSt, ":name");
+    int res = sqlite3_bind_text(pSt, (i > 0) ? i : 1, name, -1, SQLITE_STATIC);
+
+    if(res == SQLITE_OK && (i = sqlite3_bind_parameter_index(pSt, ":hash")) > 0) {
+        res = sqlite3_bind_int64(pSt, i, name_hash(name));
+    }
+    return res;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_DB_H
+#define NSS_SQLITE_DB_H
+
+#include "utils.h"
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct nss_shard;
+
+/*
+ * Tables whose keys are learned when a DB is opened.
+ */
+enum nss_key_table {
+    KEYS_PASSWD,
+    KEYS_GROUPS,
+    KEYS_SHADOW,
+    KEY_TABLES
+};
+
+/*
+ * Keys of a table: lookups for other keys are answered without running
+ * their query.
+ */
+struct nss_keys {
+    int names;                      /* first bytes of the names known */
+    unsigned char first[32];        /* bitmap of these first bytes */
+    int ids;                        /* id range known */
+    sqlite3_int64 min, max;
+};
+
+/*
+ * Connection to a database kept open for the whole process life, along
+ * with its prepared statements.
+ */
+struct nss_db {
+    const char* path;
+    const char* replica;            /* local copy of path lookups are
+                                       served from, NULL if none */
+    pthread_mutex_t mutex;          /* held between db_acquire and db_release */
+    int depth;                      /* number of statements acquired */
+    struct sqlite3* pDb;
+    pid_t pid;                      /* process which opened pDb */
+    struct stat st;                 /* file pDb was opened on */
+    int broken;                     /* pDb must be reopened */
+    char* sql[QUERY_COUNT];         /* nss_queries overrides, NULL if the
+                                       compiled in query is used */
+    struct sqlite3_stmt* stmts[QUERY_COUNT];
+    int rowid[QUERY_COUNT];         /* query is a seek on a rowid alias */
+    int deadlines[QUERY_COUNT];     /* nss_queries deadline column (ms),
+                                       -1 if it doesn't give one */
+    struct nss_deadline outer[QUERY_COUNT]; /* deadline of the statement a
+                                       query is nested in */
+    struct sqlite3* pSource;        /* connection to path, replica source */
+    pid_t source_pid;               /* process which opened pSource */
+    int data_version;               /* of pSource when last checked */
+    time_t replica_checked;         /* last time path was checked */
+    const char* serving;            /* file currently used, replica or path */
+    int is_shard;                   /* shard of another DB */
+    struct nss_shard* shards;       /* from nss_shards, NULL if unsharded */
+    int shard_count;
+    struct nss_db** layers;         /* DBs listed by a colon separated path,
+                                       NULL until needed */
+    int layer_count;
+    unsigned generation;            /* of the settings pDb was opened with */
+    struct nss_keys keys[KEY_TABLES];
+    int keys_version;               /* data_version keys were learned at */
+};
+
+#define NSS_DB_INIT(path, replica) { (path), (replica), PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+
+extern struct nss_db passwd_db;
+extern struct nss_db shadow_db;
+
+enum nss_status db_acquire(struct nss_db*, enum nss_query, struct sqlite3_stmt**);
+enum nss_status db_acquire_key(struct nss_db**, enum nss_query, const char*, sqlite3_int64,
+                               struct sqlite3_stmt**);
+enum nss_status db_shard(struct nss_db*, int, struct nss_db**);
+enum nss_status db_layer(struct nss_db*, int, struct nss_db**);
+enum nss_status db_part(struct nss_db*, int*, int*, struct nss_db**);
+int db_shadowed(struct nss_db*, int, enum nss_query, const char*);
+enum nss_status db_step(struct nss_db*, struct sqlite3_stmt*);
+void db_release(struct nss_db*, struct sqlite3_stmt*);
+int db_bind_name(struct sqlite3_stmt*, const char*);
+void db_configure(void);
+
+#endif
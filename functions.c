@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * functions.c : SQL functions registered on the module's connections.
+ */
+
+#include "functions.h"
+
+#include <endian.h>
+#include <grp.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef NSS_SQLITE_EXTENSION
+SQLITE_EXTENSION_INIT1
+#endif
+
+/*
+ * nss_pack_gids aggregate state.
+ */
+struct gid_pack {
+    gid_t* gids;
+    int count;
+    int size;
+};
+
+static void pack_gids_step(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    struct gid_pack* pack = sqlite3_aggregate_context(ctx, sizeof(*pack));
+
+    if(pack == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    if(sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        return;
+    }
+    if(pack->count == pack->size) {
+        int size = (pack->size == 0) ? 32 : pack->size * 2;
+        gid_t* gids = sqlite3_realloc64(pack->gids, size * sizeof(gid_t));
+        if(gids == NULL) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+        pack->gids = gids;
+        pack->size = size;
+    }
+    pack->gids[pack->count++] = sqlite3_value_int64(argv[0]);
+}
+
+static void pack_gids_final(sqlite3_context* ctx) {
+    struct gid_pack* pack = sqlite3_aggregate_context(ctx, 0);
+
+    if(pack == NULL || pack->count == 0) {
+        /* no row, still a blob so that it's not mistaken for a gid */
+        sqlite3_result_zeroblob(ctx, 0);
+        if(pack != NULL) {
+            sqlite3_free(pack->gids);
+        }
+        return;
+    }
+    sqlite3_result_blob(ctx, pack->gids, pack->count * sizeof(gid_t), sqlite3_free);
+}
+
+sqlite3_int64 name_hash(const char* name) {
+    sqlite3_uint64 hash = 14695981039346656037ULL;
+
+    for( ; *name != '\0' ; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+    }
+    return (sqlite3_int64)hash;
+}
+
+static void name_hash_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    const char* name = (const char*)sqlite3_value_text(argv[0]);
+
+    if(name == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sqlite3_result_int64(ctx, name_hash(name));
+}
+
+/*
+ * nss_name_shard(name, count): shard a name is stored in when the users'
+ * DB is split in count shards, see conf/shards.sql.
+ */
+static void name_shard_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    const char* name = (const char*)sqlite3_value_text(argv[0]);
+    sqlite3_int64 count = sqlite3_value_int64(argv[1]);
+
+    if(name == NULL || count <= 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sqlite3_result_int64(ctx, (sqlite3_uint64)name_hash(name) % count);
+}
+
+static void put32(unsigned char* p, uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static const char* text_arg(sqlite3_value* arg) {
+    const char* text = (const char*)sqlite3_value_text(arg);
+    return (text != NULL) ? text : "";
+}
+
+/* nss_pack_passwd(username, passwd, uid, gid, gecos, homedir, shell) */
+static void pack_passwd_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    static const int strings[] = { 0, 1, 4, 5, 6 };
+    size_t size = PACKED_PASSWD_HEADER, offset = 0;
+    unsigned char* record;
+    int i;
+
+    for(i = 0 ; i < 5 ; ++i) {
+        if(i < 3 || sqlite3_value_type(argv[strings[i]]) != SQLITE_NULL) {
+            size += strlen(text_arg(argv[strings[i]])) + 1;
+        }
+    }
+    if((record = sqlite3_malloc64(size)) == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    put32(record, sqlite3_value_int64(argv[2]));
+    put32(record + 4, sqlite3_value_int64(argv[3]));
+    for(i = 0 ; i < 5 ; ++i) {
+        const char* text = text_arg(argv[strings[i]]);
+        size_t l = strlen(text) + 1;
+        if(i >= 3 && sqlite3_value_type(argv[strings[i]]) == SQLITE_NULL) {
+            /* homedir and shell, given by the settings */
+            put32(record + 8 + i * 4, PACKED_NULL);
+            continue;
+        }
+        put32(record + 8 + i * 4, offset);
+        memcpy(record + PACKED_PASSWD_HEADER + offset, text, l);
+        offset += l;
+    }
+    sqlite3_result_blob(ctx, record, size, sqlite3_free);
+}
+
+/* nss_pack_group(gid, groupname, passwd, members) */
+static void pack_group_func(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    const char* name = text_arg(argv[1]);
+    const char* passwd = text_arg(argv[2]);
+    const char* members = text_arg(argv[3]);
+    size_t name_length = strlen(name) + 1, passwd_length = strlen(passwd) + 1;
+    size_t members_length = strlen(members) + 1;
+    size_t count = 0, header, offset, i;
+    unsigned char *record, *h;
+    char* strings;
+
+    if(*members != '\0') {
+        for(count = 1, i = 0 ; members[i] != '\0' ; ++i) {
+            count += (members[i] == ',');
+        }
+    }
+    header = PACKED_GROUP_HEADER + count * 4;
+    if((record = sqlite3_malloc64(header + name_length + passwd_length + members_length)) == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    put32(record, sqlite3_value_int64(argv[0]));
+    put32(record + 4, count);
+    put32(record + 8, 0);
+    put32(record + 12, name_length);
+    strings = (char*)record + header;
+    memcpy(strings, name, name_length);
+    memcpy(strings + name_length, passwd, passwd_length);
+
+    /* members are cut in place */
+    offset = name_length + passwd_length;
+    memcpy(strings + offset, members, members_length);
+    h = record + PACKED_GROUP_HEADER;
+    for(i = 0 ; i < count ; ++i) {
+        char* end = strchr(strings + offset, ',');
+        put32(h + i * 4, offset);
+        if(end != NULL) {
+            *end = '\0';
+            offset = end + 1 - strings;
+        }
+    }
+    /* an empty list still leaves its NUL */
+    sqlite3_result_blob(ctx, record, header + name_length + passwd_length + members_length, sqlite3_free);
+}
+
+/*
+ * Register the module functions on a connection.
+ * @param pDb Connection.
+ * @return SQLITE_OK or an SQLite error code.
+ */
+int register_functions(struct sqlite3* pDb) {
+    int res = sqlite3_create_function(pDb, "nss_pack_gids", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL, NULL, pack_gids_step, pack_gids_final);
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    res = sqlite3_create_function(pDb, "nss_name_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+            NULL, name_hash_func, NULL, NULL);
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    res = sqlite3_create_function(pDb, "nss_name_shard", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+            NULL, name_shard_func, NULL, NULL);
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    res = sqlite3_create_function(pDb, "nss_pack_passwd", 7, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+            NULL, pack_passwd_func, NULL, NULL);
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    res = sqlite3_create_function(pDb, "nss_pack_group", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+            NULL, pack_group_func, NULL, NULL);
+    if(res != SQLITE_OK) {
+        return res;
+    }
+    return register_bitmap_functions(pDb);
+}
+
+#ifdef NSS_SQLITE_EXTENSION
+/*
+ * Extension entry point, for sqlite3's .load nss_sqlite
+ */
+int sqlite3_nsssqlite_init(struct sqlite3* pDb, char** err, const sqlite3_api_routines* pApi) {
+    SQLITE_EXTENSION_INIT2(pApi);
+    return register_functions(pDb);
+}
+#endif
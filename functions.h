@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_FUNCTIONS_H
+#define NSS_SQLITE_FUNCTIONS_H
+
+/*
+ * These sources are also built as an SQLite loadable extension, so that
+ * programs writing the DB can use the functions.
+ */
+#ifdef NSS_SQLITE_EXTENSION
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+#else
+#include <sqlite3.h>
+#endif
+
+/*
+ * 64 bits FNV-1a hash of a user or group name, also available in SQL as
+ * nss_name_hash(name) to maintain hash columns.
+ */
+sqlite3_int64 name_hash(const char*);
+
+/*
+ * nss_pack_passwd(username, passwd, uid, gid, gecos, homedir, shell) and
+ * nss_pack_group(gid, groupname, passwd, members) build a record ready
+ * to be copied to the caller buffer (members being a comma separated
+ * list). Records are little endian 32 bits integers followed by the
+ * NUL terminated strings, offsets being relative to the strings:
+ *   passwd: uid, gid, name, passwd, gecos, homedir and shell offsets
+ *   group: gid, member count, name and passwd offsets, members offsets
+ * A NULL homedir or shell has the PACKED_NULL offset and no string, so
+ * that it is given by the settings like on the SQL path.
+ */
+#define PACKED_PASSWD_HEADER (7 * 4)
+#define PACKED_GROUP_HEADER (4 * 4)
+#define PACKED_NULL 0xffffffffU
+
+/*
+ * nss_pack_gids(gid) aggregates gids into a blob of native gid_t, which
+ * initgroups_dyn copies as is.
+ */
+int register_functions(struct sqlite3*);
+
+/*
+ * nss_rb_add(bitmap, uid), nss_rb_remove(bitmap, uid),
+ * nss_rb_contains(bitmap, uid), nss_rb_build(uid) aggregate and
+ * nss_rb_each(bitmap) table valued function, see bitmap.c.
+ */
+int register_bitmap_functions(struct sqlite3*);
+
+#endif
@@ -20,12 +20,16 @@
  * groups.c : Functions handling groups entries retrieval.
  */
 #include "nss-sqlite.h"
+#include "cache.h"
+#include "db.h"
+#include "settings.h"
 #include "utils.h"
 
 #include <errno.h>
 #include <grp.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -39,6 +43,11 @@ static struct {
                             to getgrent_r */
     /* group information cache used if NSS_TRYAGAIN was returned */
     struct group entry;
+    const char* members;
+    int deadline;       /* nss_queries deadline of the query */
+    int layer;          /* layer and shard being enumerated... */
+    int shard;
+    struct nss_db* db;  /* ... and its DB, for members lookups */
 } grent_data = { NULL, NULL, 0, NULL};
 
 /* mutex used to serialize xxgrent operation */
@@ -58,34 +67,62 @@ static void free_2Dtable(char** t, int c) {
     free(t);
 }
 
+/*
+ * Open the connection enumerating a part (see db_part) of the users' DB,
+ * grent_mutex being held.
+ * @param layer Layer number, 0 if the DB isn't layered.
+ * @param shard Shard number, 0 if the layer isn't sharded.
+ * @return NSS_STATUS_NOTFOUND past the last part.
+ */
+static enum nss_status grent_open(int layer, int shard) {
+    char* sql;
+    int res = db_part(&passwd_db, &layer, &shard, &grent_data.db);
+
+    if(res != NSS_STATUS_SUCCESS) {
+        grent_data.pDb = NULL;
+        return res;
+    }
+    NSS_DEBUG("setgrent: opening DB connection to %s\n", grent_data.db->path);
+    if(open_db(grent_data.db->path, &grent_data.pDb) != SQLITE_OK) {
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(!(sql = get_query(grent_data.pDb, QUERY_SETGRENT, &grent_data.deadline)) ) {
+        NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
+        sqlite3_close(grent_data.pDb);
+        grent_data.pDb = NULL;
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(sqlite3_prepare(grent_data.pDb, sql, -1, &grent_data.pSt, NULL) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
+        sqlite3_finalize(grent_data.pSt);
+        sqlite3_close(grent_data.pDb);
+        grent_data.pDb = NULL;
+        free(sql);
+        return NSS_STATUS_UNAVAIL;
+    }
+    free(sql);
+    grent_data.layer = layer;
+    grent_data.shard = shard;
+    return NSS_STATUS_SUCCESS;
+}
+
 /*
  * Initialize grent functions (serial group access).
  */
 enum nss_status _nss_sqlite_setgrent(void) {
-    char* sql;
+    enum nss_status res = NSS_STATUS_SUCCESS;
     pthread_mutex_lock(&grent_mutex);
     if(grent_data.pDb == NULL) {
-        NSS_DEBUG("setgrent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &grent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(grent_data.pDb, "setgrent")) ) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            sqlite3_close(grent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(grent_data.pDb, sql, -1, &grent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(grent_data.pDb));
-            sqlite3_finalize(grent_data.pSt);
-            sqlite3_close(grent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
+        /* enumerations can be disabled by the settings */
+        const struct nss_settings* s;
+
+        settings_check();
+        s = settings_acquire();
+        res = s->enumerate ? grent_open(0, 0) : NSS_STATUS_NOTFOUND;
+        settings_release(s);
     }
-    free(sql);
     pthread_mutex_unlock(&grent_mutex);
-    return NSS_STATUS_SUCCESS;
+    return res;
 }
 
 /*
@@ -120,11 +157,16 @@ _nss_sqlite_getgrent_r(struct group *gbuf, char *buf,
     pthread_mutex_lock(&grent_mutex);
 
     if(grent_data.pDb == NULL) {
-        _nss_sqlite_setgrent();
+        res = _nss_sqlite_setgrent();
+        if(grent_data.pDb == NULL) {
+            pthread_mutex_unlock(&grent_mutex);
+            /* nothing to enumerate */
+            return (res == NSS_STATUS_NOTFOUND) ? res : NSS_STATUS_UNAVAIL;
+        }
     }
 
     if(grent_data.try_again) {
-        res = fill_group(grent_data.pDb, gbuf, buf, buflen, grent_data.entry, errnop);
+        res = fill_group(grent_data.db, gbuf, buf, buflen, grent_data.entry, grent_data.members, errnop);
         /* buffer was long enough this time */
         if(res != NSS_STATUS_TRYAGAIN || (*errnop) != ERANGE) {
             grent_data.try_again = 0;
@@ -133,17 +175,31 @@ _nss_sqlite_getgrent_r(struct group *gbuf, char *buf,
         }
     }
 
-    res = res2nss_status(sqlite3_step(grent_data.pSt), grent_data.pDb, grent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        grent_data.pDb = NULL;
-        pthread_mutex_unlock(&grent_mutex);
-        return res;
-    }
-
-    fill_group_sql(&grent_data.entry, grent_data.pSt);
+    do {
+        deadline_start(grent_data.pDb, QUERY_SETGRENT, grent_data.deadline);
+        res = res2nss_status(sqlite3_step(grent_data.pSt), grent_data.pDb, grent_data.pSt);
+        while(res == NSS_STATUS_NOTFOUND) {
+            /* go on with the next part */
+            int next = grent_open(grent_data.layer, grent_data.shard + 1);
+            if(next != NSS_STATUS_SUCCESS) {
+                res = (next == NSS_STATUS_NOTFOUND) ? res : next;
+                break;
+            }
+            deadline_start(grent_data.pDb, QUERY_SETGRENT, grent_data.deadline);
+            res = res2nss_status(sqlite3_step(grent_data.pSt), grent_data.pDb, grent_data.pSt);
+        }
+        if(res != NSS_STATUS_SUCCESS) {
+            grent_data.pDb = NULL;
+            pthread_mutex_unlock(&grent_mutex);
+            return res;
+        }
+        fill_group_sql(&grent_data.entry, &grent_data.members, grent_data.pSt);
+        /* groups overridden by a previous layer were already returned */
+    } while(grent_data.layer > 0
+            && db_shadowed(&passwd_db, grent_data.layer, QUERY_GETGRNAM, grent_data.entry.gr_name));
     NSS_DEBUG("getgrent_r: fetched group #%d: %s\n", grent_data.entry.gr_gid, grent_data.entry.gr_name);
 
-    res = fill_group(grent_data.pDb, gbuf, buf, buflen, grent_data.entry, errnop);
+    res = fill_group(grent_data.db, gbuf, buf, buflen, grent_data.entry, grent_data.members, errnop);
     if(res == NSS_STATUS_TRYAGAIN && (*errnop) == ERANGE) {
         /* cache result for next try */
         grent_data.try_again = 1;
@@ -165,58 +221,63 @@ _nss_sqlite_getgrent_r(struct group *gbuf, char *buf,
  * an error occurs.
  */
 
-enum nss_status
-_nss_sqlite_getgrnam_r(const char* name, struct group *gbuf,
+static enum nss_status
+getgrnam_db(struct nss_db* db, const char* name, struct group *gbuf,
                       char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
     struct sqlite3_stmt* pSt;
     struct group entry;
+    const char* members;
     int res;
-    char* sql;
 
     NSS_DEBUG("getgrnam_r : looking for group %s\n", name);
 
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    res = db_acquire_key(&db, QUERY_GETGRNAM, name, 0, &pSt);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
-    if(!(sql = get_query(pDb, "getgrnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(db_bind_name(pSt, name) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        db_release(db, pSt);
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
+    res = db_step(db, pSt);
+    if(res == NSS_STATUS_SUCCESS && sqlite3_column_type(pSt, 0) == SQLITE_BLOB) {
+        /* nss_pack_group record */
+        res = fill_group_packed(gbuf, buf, buflen, sqlite3_column_blob(pSt, 0),
+                sqlite3_column_bytes(pSt, 0), errnop);
+    } else if(res == NSS_STATUS_SUCCESS) {
+        fill_group_sql(&entry, &members, pSt);
+        res = fill_group(db, gbuf, buf, buflen, entry, members, errnop);
     }
 
-    if(sqlite3_bind_text(pSt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
+    db_release(db, pSt);
+    return res;
+}
 
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
-        return res;
+/*
+ * getgrnam_r entry point, falls back on the last known good record
+ * when the DB can't be used.
+ */
+enum nss_status
+_nss_sqlite_getgrnam_r(const char* name, struct group *gbuf,
+                      char *buf, size_t buflen, int *errnop) {
+    struct nss_db* db;
+    int err = 0, i;
+    enum nss_status res;
+
+    /* the first layer knowing the group wins */
+    for(i = 0 ; (res = db_layer(&passwd_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        res = getgrnam_db(db, name, gbuf, buf, buflen, &err);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    res = cache_group(CACHE_GRNAM, name, 0, res, gbuf, buf, buflen, &err);
+    if(err != 0) {
+        *errnop = err;
     }
-
-    fill_group_sql(&entry, pSt);
-
-    res = fill_group(pDb, gbuf, buf, buflen, entry, errnop);
-
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
     return res;
 }
 
@@ -230,61 +291,208 @@ _nss_sqlite_getgrnam_r(const char* name, struct group *gbuf,
  * an error occurs.
  */
 
-enum nss_status
-_nss_sqlite_getgrgid_r(gid_t gid, struct group *gbuf,
+static enum nss_status
+getgrgid_db(struct nss_db* db, gid_t gid, struct group *gbuf,
                       char *buf, size_t buflen, int *errnop) {
-     sqlite3 *pDb;
-     struct sqlite3_stmt* pSt;
-     struct group entry;
-     int res;
-     char* sql;
-
+    struct sqlite3_stmt* pSt;
+    struct group entry;
+    const char* members;
+    int res;
 
     NSS_DEBUG("getgrgid_r : looking for group #%d\n", gid);
 
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    res = db_acquire_key(&db, QUERY_GETGRGID, NULL, gid, &pSt);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
-    if(!(sql = get_query(pDb, "getgrgid_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        db_release(db, pSt);
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+    res = db_step(db, pSt);
+    if(res == NSS_STATUS_SUCCESS && sqlite3_column_type(pSt, 0) == SQLITE_BLOB) {
+        /* nss_pack_group record */
+        res = fill_group_packed(gbuf, buf, buflen, sqlite3_column_blob(pSt, 0),
+                sqlite3_column_bytes(pSt, 0), errnop);
+    } else if(res == NSS_STATUS_SUCCESS) {
+        fill_group_sql(&entry, &members, pSt);
+        res = fill_group(db, gbuf, buf, buflen, entry, members, errnop);
+    }
+
+    db_release(db, pSt);
+    return res;
+}
+
+/*
+ * getgrgid_r entry point, falls back on the last known good record
+ * when the DB can't be used.
+ */
+enum nss_status
+_nss_sqlite_getgrgid_r(gid_t gid, struct group *gbuf,
+                      char *buf, size_t buflen, int *errnop) {
+    struct nss_db* db;
+    int err = 0, i;
+    enum nss_status res;
+
+    for(i = 0 ; (res = db_layer(&passwd_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        res = getgrgid_db(db, gid, gbuf, buf, buflen, &err);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    res = cache_group(CACHE_GRGID, NULL, gid, res, gbuf, buf, buflen, &err);
+    if(err != 0) {
+        *errnop = err;
+    }
+    return res;
+}
+
+/*
+ * Make room for count more groups in groupsp, see initgroups_dyn.
+ */
+static enum nss_status grow_groups(long int count, long int *start, long int *size,
+                                   gid_t **groupsp, long int limit, int *errnop) {
+    long int needed = *start + count;
+    long int new_size = (*size > 0) ? *size : 1;
+
+    if(needed <= *size) {
+        return NSS_STATUS_SUCCESS;
+    }
+    while(new_size < needed) {
+        new_size *= 2;
+    }
+    if(limit > 0) {
+        if(needed > limit) {
+            /* limit reached, tell caller to try with a bigger one */
+            NSS_ERROR("initgroups_dyn: limit was too low\n");
+            *errnop = ERANGE;
+            return NSS_STATUS_TRYAGAIN;
+        }
+        if(new_size > limit) {
+            new_size = limit;
+        }
+    }
+    *groupsp = realloc(*groupsp, sizeof(**groupsp) * new_size);
+    *size = new_size;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * initgroups_dyn on a DB, see below.
+ */
+static enum nss_status
+initgroups_db(struct nss_db* db, const char *user, gid_t gid, long int *start,
+              long int *size, gid_t **groupsp, long int limit, int *errnop) {
+    struct sqlite3_stmt *pSt;
+    int res, gid_param;
+    long int first = *start;
+    NSS_DEBUG("initgroups_dyn: filling groups for user : %s, main gid : %d\n", user, gid);
+
+    res = db_acquire_key(&db, QUERY_INITGROUPS, user, 0, &pSt);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
+    }
+
+    if(db_bind_name(pSt, user) != SQLITE_OK) {
+        NSS_ERROR("Unable to bind username in initgroups_dyn\n");
+        db_release(db, pSt);
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
+    /* The main gid is optional, a packed query may filter it out itself */
+    gid_param = sqlite3_bind_parameter_index(pSt, ":gid");
+    if(gid_param == 0 && sqlite3_bind_parameter_count(pSt) >= 2 && sqlite3_bind_parameter_index(pSt, ":name") == 0) {
+        gid_param = 2;
+    }
+    if(gid_param > 0 && sqlite3_bind_int(pSt, gid_param, gid) != SQLITE_OK) {
+        NSS_ERROR("Unable to bind gid in initgroups_dyn\n");
+        db_release(db, pSt);
         return NSS_STATUS_UNAVAIL;
     }
 
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
+    res = db_step(db, pSt);
     if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
+        db_release(db, pSt);
         return res;
     }
 
-    fill_group_sql(&entry, pSt);
+    do {
+        if(sqlite3_column_type(pSt, 0) == SQLITE_BLOB) {
+            /* nss_pack_gids(gid): native gid_t array, copied as is */
+            const gid_t* packed = sqlite3_column_blob(pSt, 0);
+            long int i, count = sqlite3_column_bytes(pSt, 0) / sizeof(gid_t);
+            gid_t* dest;
+
+            NSS_DEBUG("initgroups_dyn: adding %ld packed groups\n", count);
+            res = grow_groups(count, start, size, groupsp, limit, errnop);
+            if(res != NSS_STATUS_SUCCESS) {
+                db_release(db, pSt);
+                *start = first;
+                return res;
+            }
+            dest = *groupsp + *start;
+            memcpy(dest, packed, count * sizeof(gid_t));
+            for(i = 0 ; i < count ; ++i) {
+                if(dest[i] != gid) {
+                    (*groupsp)[(*start)++] = dest[i];
+                }
+            }
+        } else if(sqlite3_column_type(pSt, 0) == SQLITE_TEXT) {
+            /* comma separated list, e.g. from conf/user_gids.sql */
+            const char* list = (const char*)sqlite3_column_text(pSt, 0);
+            long int count = 1;
+            char* end;
+
+            for(end = (char*)list ; *end != '\0' ; ++end) {
+                count += (*end == ',');
+            }
+            NSS_DEBUG("initgroups_dyn: adding groups %s\n", list);
+            res = grow_groups(count, start, size, groupsp, limit, errnop);
+            if(res != NSS_STATUS_SUCCESS) {
+                db_release(db, pSt);
+                *start = first;
+                return res;
+            }
+            while(*list != '\0') {
+                gid_t g = strtoul(list, &end, 10);
+                if(end != list && g != gid) {
+                    (*groupsp)[(*start)++] = g;
+                }
+                list = (*end != '\0') ? end + 1 : end;
+            }
+        } else if(sqlite3_column_type(pSt, 0) != SQLITE_NULL) {
+            int gid = sqlite3_column_int(pSt, 0);
+            NSS_DEBUG("initgroups_dyn: adding group %d\n", gid);
+            res = grow_groups(1, start, size, groupsp, limit, errnop);
+            if(res != NSS_STATUS_SUCCESS) {
+                db_release(db, pSt);
+                *start = first;
+                return res;
+            }
+            (*groupsp)[*start] = gid;
+            (*start)++;
+        }
+        res = db_step(db, pSt);
+    } while(res == NSS_STATUS_SUCCESS);
 
-    res = fill_group(pDb, gbuf, buf, buflen, entry, errnop);
+    db_release(db, pSt);
 
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
-    return res;
+    if(res != NSS_STATUS_NOTFOUND) {
+        /* aborted (deadline reached, I/O error...), don't return a partial list */
+        *start = first;
+        return res;
+    }
+    if(*start == first) {
+        /* an empty nss_pack_gids blob or list */
+        return NSS_STATUS_NOTFOUND;
+    }
+    *groupsp = realloc(*groupsp, sizeof(**groupsp) * (*start));
+    *size = *start;
 
+    return NSS_STATUS_SUCCESS;
 }
 
 /*
@@ -307,88 +515,21 @@ enum nss_status
 _nss_sqlite_initgroups_dyn(const char *user, gid_t gid, long int *start,
                           long int *size, gid_t **groupsp, long int limit,
                                                     int *errnop) {
-    sqlite3 *pDb;
-    struct sqlite3_stmt *pSt;
-    char* sql;
-    int res;
-    NSS_DEBUG("initgroups_dyn: filling groups for user : %s, main gid : %d\n", user, gid);
-
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(!(sql = get_query(pDb, "initgroups_dyn")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_prepare(pDb, sql, -1, &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_bind_text(pSt, 1, user, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_ERROR("Unable to bind username in initgroups_dyn\n");
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(sqlite3_bind_int(pSt, 2, gid) != SQLITE_OK) {
-        NSS_ERROR("Unable to bind gid in initgroups_dyn\n");
-        sqlite3_finalize(pSt);
-        sqlite3_close(pDb);
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    res = res2nss_status(sqlite3_step(pSt), pDb, pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(sql);
-        return res;
-    }
+    struct nss_db* db;
+    enum nss_status res;
+    int i;
 
-    do {
-        int gid = sqlite3_column_int(pSt, 0);
-        NSS_DEBUG("initgroups_dyn: adding group %d\n", gid);
-        /* Too short, doubling size */
-        if(*start == *size) {
-            if(limit > 0) {
-                if(*size < limit) {
-                    *size = (limit < (*size * 2)) ? limit : (*size * 2);
-                } else {
-                    /* limit reached, tell caller to try with a bigger one */
-                    NSS_ERROR("initgroups_dyn: limit was too low\n");
-                    *errnop = ERANGE;
-                    sqlite3_finalize(pSt);
-                    sqlite3_close(pDb);
-                    free(sql);
-                    return NSS_STATUS_TRYAGAIN;
-                }
-            } else {
-                (*size) = (*size) * 2;
-            }
-            *groupsp = realloc(*groupsp, sizeof(**groupsp) * (*size));
+    /* the first layer knowing the user wins, even if it gives no groups */
+    for(i = 0 ; (res = db_layer(&passwd_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        if(i > 0 && db_shadowed(&passwd_db, i, QUERY_GETPWNAM, user)) {
+            return NSS_STATUS_NOTFOUND;
         }
-        (*groupsp)[*start] = gid;
-        (*start)++;
-        res = sqlite3_step(pSt);
-    } while(res == SQLITE_ROW);
-    *groupsp = realloc(*groupsp, sizeof(**groupsp) * (*start));
-    *size = *start;
-
-    sqlite3_finalize(pSt);
-    sqlite3_close(pDb);
-    free(sql);
-
-    return NSS_STATUS_SUCCESS;
+        res = initgroups_db(db, user, gid, start, size, groupsp, limit, errnop);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    return res;
 }
 
 /*
@@ -396,58 +537,45 @@ _nss_sqlite_initgroups_dyn(const char *user, gid_t gid, long int *start,
  * @param buffer Buffer which will contain all users' names headed
  * with a char* pointers area containing pointer to members' names,
  * ending by NULL.
- * @param pDb DB handle to fetch users (must be opened).
+ * @param db DB to fetch users from.
  * @param gid GID.
  * @param buflen Buffer length.
  * @param errnop Pointer to errno, will be filled if an error occurs.
  */
 
-enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen, int* errnop) {
+enum nss_status get_users(struct nss_db* db, gid_t gid, char* buffer, size_t buflen, int* errnop) {
     struct sqlite3_stmt *pSt;
-    int res, msize = 20, mcount = 0, i, ptr_area_size;
-    char* sql;
-    char* next_member;
+    int res, msize = 20, mcount = 0;
     char **members;
     char **ptr_area = (char**)buffer;
 
     NSS_DEBUG("get_users: looking for members of group #%d\n", gid);
-    
-    if(!(sql = get_query(pDb, "get_users")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
 
-    if(sqlite3_prepare(pDb, sql, strlen(sql), &pSt, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
-        return NSS_STATUS_UNAVAIL;
+    res = db_acquire(db, QUERY_GET_USERS, &pSt);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
     if(sqlite3_bind_int(pSt, 1, gid) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_finalize(pSt);
+        NSS_ERROR(sqlite3_errmsg(db->pDb));
+        db_release(db, pSt);
         return NSS_STATUS_UNAVAIL;
-        free(sql);
     }
 
-    res = sqlite3_step(pSt);
+    res = db_step(db, pSt);
 
-    if(res != SQLITE_ROW) {
-        sqlite3_finalize(pSt);
-        if(res == SQLITE_DONE) {
+    if(res != NSS_STATUS_SUCCESS) {
+        db_release(db, pSt);
+        if(res == NSS_STATUS_NOTFOUND) {
             NSS_DEBUG("get_users: No member found\n");
             if(buflen < sizeof(char*)) {
                 *errnop = ERANGE;
-                free(sql);
                 return NSS_STATUS_TRYAGAIN;
             }
             ptr_area[0] = NULL;
-            free(sql);
             return NSS_STATUS_SUCCESS;
         }
-        free(sql);
-        return NSS_STATUS_UNAVAIL;
+        return res;
     }
 
     /* members is a buffer to temporary hold members (we need to know the count
@@ -463,11 +591,37 @@ enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen,
         }
         members[mcount] = strdup((char*)member);
         ++mcount;
-        res = sqlite3_step(pSt);
-    } while(res == SQLITE_ROW);
+        res = db_step(db, pSt);
+    } while(res == NSS_STATUS_SUCCESS);
 
-    free(sql);
-    sqlite3_finalize(pSt);
+    db_release(db, pSt);
+
+    if(res != NSS_STATUS_NOTFOUND) {
+        /* aborted (deadline reached, I/O error...), don't return a partial list */
+        free_2Dtable(members, mcount);
+        return res;
+    }
+
+    res = copy_members(members, mcount, buffer, buflen, errnop);
+    free_2Dtable(members, mcount);
+    return res;
+}
+
+/*
+ * Lay members out in a buffer.
+ * @param members Members' names.
+ * @param mcount Number of members.
+ * @param buffer Buffer which will contain all members' names headed
+ * with a char* pointers area containing pointer to members' names,
+ * ending by NULL.
+ * @param buflen Buffer length.
+ * @param errnop Pointer to errno, will be filled if an error occurs.
+ */
+
+enum nss_status copy_members(char** members, int mcount, char* buffer, size_t buflen, int* errnop) {
+    int i, ptr_area_size;
+    char* next_member;
+    char **ptr_area = (char**)buffer;
 
     /* Here is what we want to get :
      * __________________________________________________
@@ -480,7 +634,6 @@ enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen,
     ptr_area_size = (mcount + 1) * sizeof(char *);
 
     if(buflen < ptr_area_size) {
-        free_2Dtable(members, mcount);
         (*errnop) = ERANGE;
         return NSS_STATUS_TRYAGAIN;
     }
@@ -490,7 +643,6 @@ enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen,
     for(i = 0 ; i < mcount ; ++i) {
         int l = strlen(members[i]) + 1;
         if(buflen < l) {
-            free_2Dtable(members, mcount);
             (*errnop) = ERANGE;
             return NSS_STATUS_TRYAGAIN;
         }
@@ -500,7 +652,5 @@ enum nss_status get_users(sqlite3* pDb, gid_t gid, char* buffer, size_t buflen,
         next_member  += l;
     }
     ptr_area[i] = NULL;
-    free_2Dtable(members, mcount);
-    return TRUE;
+    return NSS_STATUS_SUCCESS;
 }
-
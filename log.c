@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * log.c : Rate limited logging.
+ */
+
+#include "nss-sqlite.h"
+#include "stats.h"
+
+#include <stdarg.h>
+#include <time.h>
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * syslog a message unless its call site already used up its tokens.
+ * @param site Call site state, see NSS_ERROR.
+ * @param priority syslog priority.
+ * @param format printf like format.
+ */
+void nss_log(struct nss_log_site* site, int priority, const char* format, ...) {
+    unsigned long suppressed = 0;
+    int allowed = FALSE;
+    double now = seconds();
+    va_list ap;
+
+    pthread_mutex_lock(&site->mutex);
+    if(!site->started) {
+        site->started = TRUE;
+        site->tokens = NSS_LOG_BURST;
+        site->last = now;
+        site->last_summary = now;
+    }
+
+    site->tokens += (now - site->last) / NSS_LOG_PERIOD;
+    if(site->tokens > NSS_LOG_BURST) {
+        site->tokens = NSS_LOG_BURST;
+    }
+    site->last = now;
+
+    if(site->tokens >= 1) {
+        site->tokens -= 1;
+        allowed = TRUE;
+    } else {
+        site->suppressed++;
+        STATS_INC(log_suppressed);
+    }
+
+    /* Report dropped messages before the next one goes through, or
+     * periodically while they keep being dropped */
+    if(site->suppressed > 0 && (allowed || now - site->last_summary >= NSS_LOG_SUMMARY)) {
+        suppressed = site->suppressed;
+        site->suppressed = 0;
+        site->last_summary = now;
+    }
+    pthread_mutex_unlock(&site->mutex);
+
+    if(suppressed > 0) {
+        syslog(priority, "%s:%d: %lu similar messages suppressed\n", site->file, site->line, suppressed);
+    }
+    if(allowed) {
+        va_start(ap, format);
+        vsyslog(priority, format, ap);
+        va_end(ap);
+    }
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * nss-sqlite-pack.c : Write the page compressed copy of a DB the zstd VFS
+ * reads (see vfs.h for the format).
+ *
+ * usage: nss-sqlite-pack [-l level] [-g pages] source destination
+ *
+ * A read transaction is held on the source while it is copied, so the
+ * copy is consistent. The destination is written to a temporary file
+ * renamed over it once complete.
+ */
+
+#include "vfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+static void put_le32(unsigned char* p, unsigned int v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le64(unsigned char* p, sqlite3_uint64 v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static sqlite3_int64 pragma_int(sqlite3* pDb, const char* sql) {
+    sqlite3_stmt* pSt;
+    sqlite3_int64 res = -1;
+
+    if(sqlite3_prepare_v2(pDb, sql, -1, &pSt, NULL) == SQLITE_OK
+            && sqlite3_step(pSt) == SQLITE_ROW) {
+        res = sqlite3_column_int64(pSt, 0);
+    }
+    sqlite3_finalize(pSt);
+    return res;
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: nss-sqlite-pack [-l level] [-g pages] source destination\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    int level = 19;
+    unsigned int group_pages = 4;
+    sqlite3* pDb;
+    sqlite3_int64 page_size, size, group_size, offset;
+    unsigned int groups, i;
+    unsigned char* header;
+    size_t header_len;
+    void* data;
+    void* frame;
+    size_t frame_max;
+    ZSTD_CCtx* cctx;
+    struct stat st;
+    char* tmp;
+    int in, out, opt;
+
+    while((opt = getopt(argc, argv, "l:g:")) != -1) {
+        switch(opt) {
+            case 'l':
+                level = atoi(optarg);
+                break;
+            case 'g':
+                group_pages = atoi(optarg);
+                break;
+            default:
+                return usage();
+        }
+    }
+    if(argc - optind != 2 || group_pages == 0 || group_pages > 4096) {
+        return usage();
+    }
+
+    if(sqlite3_open_v2(argv[optind], &pDb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+            || sqlite3_exec(pDb, "BEGIN; SELECT count(*) FROM sqlite_master", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", argv[optind], sqlite3_errmsg(pDb));
+        return 1;
+    }
+    if(pragma_int(pDb, "SELECT journal_mode = 'wal' FROM pragma_journal_mode") != 0) {
+        fprintf(stderr, "%s: WAL DBs can't be packed, use PRAGMA journal_mode = DELETE first\n", argv[optind]);
+        return 1;
+    }
+    page_size = pragma_int(pDb, "PRAGMA page_size");
+    size = page_size * pragma_int(pDb, "PRAGMA page_count");
+    group_size = page_size * group_pages;
+    groups = (size + group_size - 1) / group_size;
+
+    if((in = open(argv[optind], O_RDONLY)) < 0 || fstat(in, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    tmp = malloc(strlen(argv[optind + 1]) + 8);
+    sprintf(tmp, "%s.XXXXXX", argv[optind + 1]);
+    if((out = mkstemp(tmp)) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    header_len = ZSTD_PACK_HEADER + (groups + 1) * 8;
+    frame_max = ZSTD_compressBound(group_size);
+    header = calloc(1, header_len);
+    data = malloc(group_size);
+    frame = malloc(frame_max);
+    cctx = ZSTD_createCCtx();
+    if(header == NULL || data == NULL || frame == NULL || cctx == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        unlink(tmp);
+        return 1;
+    }
+
+    memcpy(header, ZSTD_PACK_MAGIC, 8);
+    put_le32(header + 8, page_size);
+    put_le32(header + 12, group_pages);
+    put_le64(header + 16, size);
+    put_le32(header + 24, groups);
+
+    offset = header_len;
+    for(i = 0 ; i < groups ; ++i) {
+        sqlite3_int64 len = size - i * group_size;
+        size_t res;
+
+        if(len > group_size) {
+            len = group_size;
+        }
+        if(pread(in, data, len, i * group_size) != len) {
+            fprintf(stderr, "%s: short read\n", argv[optind]);
+            unlink(tmp);
+            return 1;
+        }
+        res = ZSTD_compressCCtx(cctx, frame, frame_max, data, len, level);
+        if(ZSTD_isError(res)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(res));
+            unlink(tmp);
+            return 1;
+        }
+        if(pwrite(out, frame, res, offset) != (ssize_t)res) {
+            perror(tmp);
+            unlink(tmp);
+            return 1;
+        }
+        put_le64(header + ZSTD_PACK_HEADER + i * 8, offset);
+        offset += res;
+    }
+    put_le64(header + ZSTD_PACK_HEADER + groups * 8, offset);
+
+    if(pwrite(out, header, header_len, 0) != (ssize_t)header_len
+            || fchmod(out, st.st_mode & 07777) != 0 || fsync(out) != 0
+            || close(out) != 0 || rename(tmp, argv[optind + 1]) != 0) {
+        perror(argv[optind + 1]);
+        unlink(tmp);
+        return 1;
+    }
+
+    printf("%s: %lld bytes packed in %lld bytes (%u groups of %u pages)\n",
+            argv[optind + 1], (long long)size, (long long)offset, groups, group_pages);
+    sqlite3_close(pDb);
+    return 0;
+}
@@ -10,6 +10,7 @@
 #endif
 
 #include <nss.h>
+#include <pthread.h>
 #include <syslog.h>
 #include <stdio.h>
 
@@ -20,7 +21,37 @@
 #define NSS_DEBUG(msg, ...)
 #endif
 
-#define NSS_ERROR(msg, ...) syslog(LOG_ERR, (msg), ## __VA_ARGS__)
+/*
+ * Errors are rate limited per call site with a token bucket: a burst of
+ * NSS_LOG_BURST messages, then one every NSS_LOG_PERIOD seconds. Dropped
+ * messages are summed up at most every NSS_LOG_SUMMARY seconds.
+ */
+#define NSS_LOG_BURST 5
+#define NSS_LOG_PERIOD 10
+#define NSS_LOG_SUMMARY 60
+
+struct nss_log_site {
+    pthread_mutex_t mutex;
+    const char* file;
+    int line;
+    int started;
+    double tokens;
+    double last;                /* last refill, in seconds */
+    double last_summary;
+    unsigned long suppressed;
+};
+
+#define NSS_LOG_SITE_INIT { PTHREAD_MUTEX_INITIALIZER, __FILE__, __LINE__, 0, 0, 0, 0, 0 }
+
+void nss_log(struct nss_log_site*, int, const char*, ...);
+
+#define NSS_ERROR(msg, ...) do { \
+        static struct nss_log_site nss_log_site = NSS_LOG_SITE_INIT; \
+        nss_log(&nss_log_site, LOG_ERR, (msg), ## __VA_ARGS__); \
+    } while(0)
+
+/* Number of SQLite VM instructions between two deadline checks */
+#define NSS_DEADLINE_STEPS 1000
 
 #define FALSE 0
 #define TRUE !FALSE
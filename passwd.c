@@ -21,6 +21,9 @@
  */
 
 #include "nss-sqlite.h"
+#include "cache.h"
+#include "db.h"
+#include "settings.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -42,40 +45,72 @@ static struct {
                             to getpwent_r */
     /* user information cache used if NSS_TRYAGAIN was returned */
     struct passwd entry;
+    int deadline;       /* nss_queries deadline of the query */
+    int layer;          /* layer and shard being enumerated */
+    int shard;
 } pwent_data = { NULL, NULL, 0, NULL};
 
 /* mutex used to serialize xxpwent operation */
 pthread_mutex_t pwent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 
+/*
+ * Open the connection enumerating a part (see db_part) of the users' DB,
+ * pwent_mutex being held.
+ * @param layer Layer number, 0 if the DB isn't layered.
+ * @param shard Shard number, 0 if the layer isn't sharded.
+ * @return NSS_STATUS_NOTFOUND past the last part.
+ */
+static enum nss_status pwent_open(int layer, int shard) {
+    struct nss_db* db;
+    char* sql;
+    int res = db_part(&passwd_db, &layer, &shard, &db);
+
+    if(res != NSS_STATUS_SUCCESS) {
+        pwent_data.pDb = NULL;
+        return res;
+    }
+    NSS_DEBUG("setpwent: opening DB connection to %s\n", db->path);
+    if(open_db(db->path, &pwent_data.pDb) != SQLITE_OK) {
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(!(sql = get_query(pwent_data.pDb, QUERY_SETPWENT, &pwent_data.deadline)) ) {
+        NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
+        sqlite3_close(pwent_data.pDb);
+        pwent_data.pDb = NULL;
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(sqlite3_prepare(pwent_data.pDb, sql, -1, &pwent_data.pSt, NULL) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
+        sqlite3_finalize(pwent_data.pSt);
+        sqlite3_close(pwent_data.pDb);
+        pwent_data.pDb = NULL;
+        free(sql);
+        return NSS_STATUS_UNAVAIL;
+    }
+    free(sql);
+    pwent_data.layer = layer;
+    pwent_data.shard = shard;
+    return NSS_STATUS_SUCCESS;
+}
+
 /**
  * Setup everything needed to retrieve passwd entries.
  */
 enum nss_status _nss_sqlite_setpwent(void) {
-    char* sql;
+    enum nss_status res = NSS_STATUS_SUCCESS;
     pthread_mutex_lock(&pwent_mutex);
     if(pwent_data.pDb == NULL) {
-        NSS_DEBUG("setpwent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pwent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(pwent_data.pDb, "setpwent")) ) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            sqlite3_close(pwent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(pwent_data.pDb, sql, -1, &pwent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(pwent_data.pDb));
-            sqlite3_finalize(pwent_data.pSt);
-            sqlite3_close(pwent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
+        /* enumerations can be disabled by the settings */
+        const struct nss_settings* s;
+
+        settings_check();
+        s = settings_acquire();
+        res = s->enumerate ? pwent_open(0, 0) : NSS_STATUS_NOTFOUND;
+        settings_release(s);
     }
-    free(sql);
     pthread_mutex_unlock(&pwent_mutex);
-    return NSS_STATUS_SUCCESS;
+    return res;
 }
 
 /*
@@ -116,7 +151,12 @@ _nss_sqlite_getpwent_r(struct passwd *pwbuf, char *buf,
     pthread_mutex_lock(&pwent_mutex);
 
     if(pwent_data.pDb == NULL) {
-        _nss_sqlite_setpwent();
+        res = _nss_sqlite_setpwent();
+        if(pwent_data.pDb == NULL) {
+            pthread_mutex_unlock(&pwent_mutex);
+            /* nothing to enumerate */
+            return (res == NSS_STATUS_NOTFOUND) ? res : NSS_STATUS_UNAVAIL;
+        }
     }
 
     if(pwent_data.try_again) {
@@ -129,14 +169,28 @@ _nss_sqlite_getpwent_r(struct passwd *pwbuf, char *buf,
         }
     }
 
-    res = res2nss_status(sqlite3_step(pwent_data.pSt), pwent_data.pDb, pwent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        pwent_data.pDb = NULL;
-        pthread_mutex_unlock(&pwent_mutex);
-        return res;
-    }
-
-    fill_passwd_sql(&pwent_data.entry, pwent_data.pSt);
+    do {
+        deadline_start(pwent_data.pDb, QUERY_SETPWENT, pwent_data.deadline);
+        res = res2nss_status(sqlite3_step(pwent_data.pSt), pwent_data.pDb, pwent_data.pSt);
+        while(res == NSS_STATUS_NOTFOUND) {
+            /* go on with the next part */
+            int next = pwent_open(pwent_data.layer, pwent_data.shard + 1);
+            if(next != NSS_STATUS_SUCCESS) {
+                res = (next == NSS_STATUS_NOTFOUND) ? res : next;
+                break;
+            }
+            deadline_start(pwent_data.pDb, QUERY_SETPWENT, pwent_data.deadline);
+            res = res2nss_status(sqlite3_step(pwent_data.pSt), pwent_data.pDb, pwent_data.pSt);
+        }
+        if(res != NSS_STATUS_SUCCESS) {
+            pwent_data.pDb = NULL;
+            pthread_mutex_unlock(&pwent_mutex);
+            return res;
+        }
+        fill_passwd_sql(&pwent_data.entry, pwent_data.pSt);
+        /* users overridden by a previous layer were already returned */
+    } while(pwent_data.layer > 0
+            && db_shadowed(&passwd_db, pwent_data.layer, QUERY_GETPWNAM, pwent_data.entry.pw_name));
     res = fill_passwd(pwbuf, buf, buflen, pwent_data.entry, errnop);
 
     NSS_DEBUG("getpwent_r: fetched user #%d: %s\n", uid, name);
@@ -154,61 +208,62 @@ _nss_sqlite_getpwent_r(struct passwd *pwbuf, char *buf,
 
 /**
  * Get user info by username.
- * Open database connection, fetch the user by name, close the connection.
  */
 
-enum nss_status _nss_sqlite_getpwnam_r(const char* name, struct passwd *pwbuf,
+static enum nss_status getpwnam_db(struct nss_db* db, const char* name, struct passwd *pwbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
     struct sqlite3_stmt* pSquery;
-    char* query;
     int res;
     struct passwd entry;
 
     NSS_DEBUG("getpwnam_r: Looking for user %s\n", name);
 
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    res = db_acquire_key(&db, QUERY_GETPWNAM, name, 0, &pSquery);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
-    if(!(query = get_query(pDb, "getpwnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(db_bind_name(pSquery, name) != SQLITE_OK) {
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        db_release(db, pSquery);
         return NSS_STATUS_UNAVAIL;
     }
 
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
+    res = db_step(db, pSquery);
+    if(res == NSS_STATUS_SUCCESS && sqlite3_column_type(pSquery, 0) == SQLITE_BLOB) {
+        /* nss_pack_passwd record */
+        res = fill_passwd_packed(pwbuf, buf, buflen, sqlite3_column_blob(pSquery, 0),
+                sqlite3_column_bytes(pSquery, 0), errnop);
+    } else if(res == NSS_STATUS_SUCCESS) {
+        fill_passwd_sql(&entry, pSquery);
+        res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
     }
 
-    if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
+    db_release(db, pSquery);
+    return res;
+}
 
-    res = res2nss_status(sqlite3_step(pSquery), pDb, pSquery);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return res;
+/*
+ * getpwnam_r entry point, falls back on the last known good record
+ * when the DB can't be used.
+ */
+enum nss_status _nss_sqlite_getpwnam_r(const char* name, struct passwd *pwbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct nss_db* db;
+    int err = 0, i;
+    enum nss_status res;
+
+    /* the first layer knowing the user wins */
+    for(i = 0 ; (res = db_layer(&passwd_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        res = getpwnam_db(db, name, pwbuf, buf, buflen, &err);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    res = cache_passwd(CACHE_PWNAM, name, 0, res, pwbuf, buf, buflen, &err);
+    if(err != 0) {
+        *errnop = err;
     }
-
-    fill_passwd_sql(&entry, pSquery);
-    res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
-
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
-
-    NSS_DEBUG("Look successfull !\n");
     return res;
 }
 
@@ -216,60 +271,59 @@ enum nss_status _nss_sqlite_getpwnam_r(const char* name, struct passwd *pwbuf,
  * Get user by UID.
  */
 
-enum nss_status _nss_sqlite_getpwuid_r(uid_t uid, struct passwd *pwbuf,
+static enum nss_status getpwuid_db(struct nss_db* db, uid_t uid, struct passwd *pwbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
     struct sqlite3_stmt* pSquery;
-    char* query;
-    int res, nss_res;
+    int res;
     struct passwd entry;
 
     NSS_DEBUG("getpwuid_r: looking for user #%d\n", uid);
 
-    if(sqlite3_open(NSS_SQLITE_PASSWD_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-    if(!(query = get_query(pDb, "getpwuid_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
-    }
-
-
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
+    res = db_acquire_key(&db, QUERY_GETPWUID, NULL, uid, &pSquery);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
     if(sqlite3_bind_int(pSquery, 1, uid) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        db_release(db, pSquery);
         return NSS_STATUS_UNAVAIL;
     }
 
-
-    res = sqlite3_step(pSquery);
-    nss_res = res2nss_status(res, pDb, pSquery);
-    if(nss_res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return nss_res;
+    res = db_step(db, pSquery);
+    if(res == NSS_STATUS_SUCCESS && sqlite3_column_type(pSquery, 0) == SQLITE_BLOB) {
+        /* nss_pack_passwd record */
+        res = fill_passwd_packed(pwbuf, buf, buflen, sqlite3_column_blob(pSquery, 0),
+                sqlite3_column_bytes(pSquery, 0), errnop);
+    } else if(res == NSS_STATUS_SUCCESS) {
+        fill_passwd_sql(&entry, pSquery);
+        res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
     }
 
-    fill_passwd_sql(&entry, pSquery);
-    res = fill_passwd(pwbuf, buf, buflen, entry, errnop);
-   
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
+    db_release(db, pSquery);
+    return res;
+}
 
+/*
+ * getpwuid_r entry point, falls back on the last known good record
+ * when the DB can't be used.
+ */
+enum nss_status _nss_sqlite_getpwuid_r(uid_t uid, struct passwd *pwbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct nss_db* db;
+    int err = 0, i;
+    enum nss_status res;
+
+    for(i = 0 ; (res = db_layer(&passwd_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        res = getpwuid_db(db, uid, pwbuf, buf, buflen, &err);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    res = cache_passwd(CACHE_PWUID, NULL, uid, res, pwbuf, buf, buflen, &err);
+    if(err != 0) {
+        *errnop = err;
+    }
     return res;
 }
 
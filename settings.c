@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * settings.c : Configuration file.
+ */
+
+#include "nss-sqlite.h"
+#include "db.h"
+#include "settings.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef NSS_SQLITE_MMAP_VFS
+/* let SQLite fetch pages straight from the mapping */
+#define DEFAULT_MMAP_SIZE 2147418112
+#else
+#define DEFAULT_MMAP_SIZE -1
+#endif
+
+#define SETTINGS_DEFAULTS { \
+    .passwd_db = NSS_SQLITE_PASSWD_DB, \
+    .shadow_db = NSS_SQLITE_SHADOW_DB, \
+    .open_flags = 0, \
+    .mmap_size = DEFAULT_MMAP_SIZE, \
+    .sqlite_cache_size = 0, \
+    .memory_max = NSS_SQLITE_MEMORY_MAX, \
+    .cache_size = NSS_SQLITE_CACHE_SIZE, \
+    .stale_grace = NSS_SQLITE_STALE_GRACE, \
+    .open_backoff = NSS_SQLITE_OPEN_BACKOFF, \
+    .enumerate = TRUE, \
+    .query_deadline = NSS_SQLITE_QUERY_DEADLINE, \
+    .deadlines = { [0 ... QUERY_COUNT - 1] = -1 }, \
+    .stats = NULL, \
+    .homedir = NSS_SQLITE_HOMEDIR, \
+    .shell = NSS_SQLITE_SHELL, \
+    .min_uid = -1, \
+    .max_uid = -1, \
+    .min_gid = -1, \
+    .max_gid = -1, \
+    .user_prefixes = NULL, \
+    .group_prefixes = NULL, \
+    .ignore_members = FALSE, \
+    .ignore_members_of = NULL, \
+    .generation = 0, \
+    .refs = 1 \
+}
+
+static const struct nss_settings defaults = SETTINGS_DEFAULTS;
+
+/* Settings in use, replaced as a whole on reload and freed once the last
+ * lookup using them releases them. The initial ones are never freed. */
+static struct nss_settings initial = SETTINGS_DEFAULTS;
+static struct nss_settings* current = &initial;
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Database paths ever configured; DBs keep pointing to them (see
+ * db_configure), thus they are kept for the process life */
+struct path {
+    struct path* next;
+    char path[];
+};
+static struct path* paths = NULL;
+
+static pthread_mutex_t settings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t checked = -1;         /* last time the file was stat'ed */
+static struct stat loaded;          /* file the settings come from,
+                                       zeroed if there is none */
+
+static const struct {
+    const char* name;
+    int flag;
+} open_flags[] = {
+    { "nomutex", SQLITE_OPEN_NOMUTEX },
+    { "fullmutex", SQLITE_OPEN_FULLMUTEX },
+    { "nofollow", SQLITE_OPEN_NOFOLLOW },
+    { "privatecache", SQLITE_OPEN_PRIVATECACHE }
+};
+
+static int parse_int(const char* value, sqlite3_int64* n) {
+    char* end;
+
+    errno = 0;
+    *n = strtoll(value, &end, 10);
+    return errno == 0 && end != value && *end == '\0';
+}
+
+static int parse_bool(const char* value, int* b) {
+    if(strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *b = TRUE;
+    } else if(strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *b = FALSE;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Parse a list of open flags separated by spaces or commas.
+ */
+static int parse_open_flags(const char* value, int* flags) {
+    size_t len;
+    int i;
+
+    *flags = 0;
+    for(value += strspn(value, " \t,") ; *value != '\0' ; value += strspn(value, " \t,")) {
+        len = strcspn(value, " \t,");
+        for(i = 0 ; i < sizeof(open_flags) / sizeof(*open_flags) ; ++i) {
+            if(strlen(open_flags[i].name) == len && strncmp(open_flags[i].name, value, len) == 0) {
+                break;
+            }
+        }
+        if(i == sizeof(open_flags) / sizeof(*open_flags)) {
+            return FALSE;
+        }
+        *flags |= open_flags[i].flag;
+        value += len;
+    }
+    return TRUE;
+}
+
+static int parse_string(const char* value, const char** s, const char* fallback) {
+    char* copy = strdup(value);
+
+    if(copy == NULL) {
+        return FALSE;
+    }
+    if(*s != fallback) {
+        /* given twice */
+        free((char*)*s);
+    }
+    *s = copy;
+    return TRUE;
+}
+
+/*
+ * Apply a "key = value" line of the configuration file.
+ * @return FALSE if the key is unknown or the value invalid.
+ */
+static int parse_setting(struct nss_settings* s, const char* key, const char* value) {
+    sqlite3_int64 n;
+    int i;
+
+    if(strcmp(key, "passwd_db") == 0) {
+        return parse_string(value, &s->passwd_db, defaults.passwd_db);
+    } else if(strcmp(key, "shadow_db") == 0) {
+        return parse_string(value, &s->shadow_db, defaults.shadow_db);
+    } else if(strcmp(key, "stats") == 0) {
+        return parse_string(value, &s->stats, defaults.stats);
+    } else if(strcmp(key, "homedir") == 0) {
+        return parse_string(value, &s->homedir, defaults.homedir);
+    } else if(strcmp(key, "shell") == 0) {
+        return parse_string(value, &s->shell, defaults.shell);
+    } else if(strcmp(key, "user_prefixes") == 0) {
+        return parse_string(value, &s->user_prefixes, defaults.user_prefixes);
+    } else if(strcmp(key, "group_prefixes") == 0) {
+        return parse_string(value, &s->group_prefixes, defaults.group_prefixes);
+    } else if(strcmp(key, "open_flags") == 0) {
+        return parse_open_flags(value, &s->open_flags);
+    } else if(strcmp(key, "enumerate") == 0) {
+        return parse_bool(value, &s->enumerate);
+    } else if(strcmp(key, "ignore_members") == 0) {
+        return parse_bool(value, &s->ignore_members);
+    } else if(strcmp(key, "ignore_members_of") == 0) {
+        return parse_string(value, &s->ignore_members_of, defaults.ignore_members_of);
+    }
+
+    if(!parse_int(value, &n) || n < -1) {
+        return FALSE;
+    }
+    if(strcmp(key, "mmap_size") == 0) {
+        s->mmap_size = n;
+        return TRUE;
+    } else if(strcmp(key, "memory_max") == 0) {
+        s->memory_max = n;
+        return TRUE;
+    } else if(strcmp(key, "min_uid") == 0) {
+        s->min_uid = n;
+        return TRUE;
+    } else if(strcmp(key, "max_uid") == 0) {
+        s->max_uid = n;
+        return TRUE;
+    } else if(strcmp(key, "min_gid") == 0) {
+        s->min_gid = n;
+        return TRUE;
+    } else if(strcmp(key, "max_gid") == 0) {
+        s->max_gid = n;
+        return TRUE;
+    }
+
+    if(n > INT_MAX) {
+        return FALSE;
+    }
+    if(strcmp(key, "sqlite_cache_size") == 0) {
+        s->sqlite_cache_size = n;
+    } else if(strcmp(key, "cache_size") == 0) {
+        s->cache_size = n;
+    } else if(strcmp(key, "stale_grace") == 0) {
+        s->stale_grace = n;
+    } else if(strcmp(key, "open_backoff") == 0) {
+        s->open_backoff = n;
+    } else if(strcmp(key, "query_deadline") == 0) {
+        s->query_deadline = n;
+    } else if(strncmp(key, "deadline.", 9) == 0) {
+        for(i = 0 ; i < QUERY_COUNT && strcmp(key + 9, query_names[i]) != 0 ; ++i);
+        if(i == QUERY_COUNT) {
+            return FALSE;
+        }
+        s->deadlines[i] = n;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static char* trim(char* s) {
+    char* end = s + strlen(s);
+
+    while(isspace((unsigned char)*s)) {
+        s++;
+    }
+    while(end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/*
+ * Read the configuration file over the defaults. Invalid lines are
+ * logged and ignored.
+ */
+static void settings_read(FILE* in, struct nss_settings* s) {
+    char line[PATH_MAX + 64];
+    char* key;
+    char* value;
+    int n = 0;
+
+    while(fgets(line, sizeof(line), in) != NULL) {
+        n++;
+        line[strcspn(line, "#\n")] = '\0';
+        key = trim(line);
+        if(*key == '\0') {
+            continue;
+        }
+        value = strchr(key, '=');
+        if(value != NULL) {
+            *value++ = '\0';
+            key = trim(key);
+            value = trim(value);
+        }
+        if(value == NULL || !parse_setting(s, key, value)) {
+            NSS_ERROR("%s:%d: invalid setting %s\n", NSS_SQLITE_CONFIG, n, key);
+        }
+    }
+}
+
+/*
+ * Get the kept copy of a database path, settings_mutex being held.
+ * @param path Path read from the configuration file, freed.
+ * @param fallback Compiled in path.
+ * @return Kept copy, fallback if out of memory.
+ */
+static const char* keep_path(const char* path, const char* fallback) {
+    struct path* p;
+
+    if(path == fallback) {
+        return path;
+    }
+    for(p = paths ; p != NULL && strcmp(p->path, path) != 0 ; p = p->next);
+    if(p == NULL && (p = malloc(sizeof(*p) + strlen(path) + 1)) != NULL) {
+        strcpy(p->path, path);
+        p->next = paths;
+        paths = p;
+    }
+    free((char*)path);
+    return (p != NULL) ? p->path : fallback;
+}
+
+/*
+ * Free a string setting unless it is the compiled in one.
+ */
+static void free_string(const char* value, const char* fallback) {
+    if(value != fallback) {
+        free((char*)value);
+    }
+}
+
+/*
+ * Free settings replaced by a reload (database paths are kept).
+ */
+static void settings_free(struct nss_settings* s) {
+    free_string(s->stats, defaults.stats);
+    free_string(s->homedir, defaults.homedir);
+    free_string(s->shell, defaults.shell);
+    free_string(s->user_prefixes, defaults.user_prefixes);
+    free_string(s->group_prefixes, defaults.group_prefixes);
+    free_string(s->ignore_members_of, defaults.ignore_members_of);
+    free(s);
+}
+
+/*
+ * Get the settings in use, which stay valid until settings_release.
+ */
+const struct nss_settings* settings_acquire(void) {
+    struct nss_settings* s;
+
+    pthread_rwlock_rdlock(&current_lock);
+    s = current;
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&current_lock);
+    return s;
+}
+
+/*
+ * Release settings obtained by settings_acquire.
+ */
+void settings_release(const struct nss_settings* settings) {
+    struct nss_settings* s = (struct nss_settings*)settings;
+
+    if(__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0 && s != &initial) {
+        settings_free(s);
+    }
+}
+
+/*
+ * Load the configuration file the first time, then again whenever it
+ * changes; it is stat'ed at most once a second. Connections are reopened
+ * with the new settings.
+ */
+void settings_check(void) {
+    struct nss_settings* s;
+    struct nss_settings* old;
+    struct timespec now;
+    struct stat st;
+    FILE* in;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec == __atomic_load_n(&checked, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&settings_mutex);
+    if(now.tv_sec == checked) {
+        pthread_mutex_unlock(&settings_mutex);
+        return;
+    }
+    __atomic_store_n(&checked, now.tv_sec, __ATOMIC_RELAXED);
+
+    if(stat(NSS_SQLITE_CONFIG, &st) != 0) {
+        memset(&st, 0, sizeof(st));
+    }
+    if(st.st_dev == loaded.st_dev && st.st_ino == loaded.st_ino && st.st_size == loaded.st_size
+            && st.st_mtim.tv_sec == loaded.st_mtim.tv_sec && st.st_mtim.tv_nsec == loaded.st_mtim.tv_nsec) {
+        pthread_mutex_unlock(&settings_mutex);
+        return;
+    }
+
+    if((s = malloc(sizeof(*s))) == NULL) {
+        /* tried again next second */
+        pthread_mutex_unlock(&settings_mutex);
+        return;
+    }
+    *s = defaults;
+    if(st.st_ino != 0 && (in = fopen(NSS_SQLITE_CONFIG, "r")) != NULL) {
+        NSS_DEBUG("reading %s\n", NSS_SQLITE_CONFIG);
+        settings_read(in, s);
+        fclose(in);
+    }
+    s->passwd_db = keep_path(s->passwd_db, defaults.passwd_db);
+    s->shadow_db = keep_path(s->shadow_db, defaults.shadow_db);
+
+    pthread_rwlock_wrlock(&current_lock);
+    old = current;
+    s->generation = old->generation + 1;
+    current = s;
+    pthread_rwlock_unlock(&current_lock);
+    settings_release(old);
+    loaded = st;
+    pthread_mutex_unlock(&settings_mutex);
+
+    db_configure();
+}
+
+/*
+ * Tell if the members of a group are left out of its entries, which then
+ * don't need the member query. initgroups still finds the groups of a
+ * user.
+ * @param group Group name.
+ */
+int settings_ignore_members(const char* group) {
+    const struct nss_settings* s = settings_acquire();
+    const char* list = s->ignore_members_of;
+    int ignore = s->ignore_members;
+    size_t len;
+
+    if(!ignore && list != NULL) {
+        for(list += strspn(list, " \t,") ; !ignore && *list != '\0' ; list += strspn(list, " \t,")) {
+            len = strcspn(list, " \t,");
+            ignore = strncmp(list, group, len) == 0 && group[len] == '\0';
+            list += len;
+        }
+    }
+    settings_release(s);
+    return ignore;
+}
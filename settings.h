@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_SETTINGS_H
+#define NSS_SQLITE_SETTINGS_H
+
+#include "utils.h"
+
+#include <sqlite3.h>
+
+/*
+ * Settings of the module: the configure time defaults, overridden by
+ * the configuration file (NSS_SQLITE_CONFIG) when there is one.
+ */
+struct nss_settings {
+    const char* passwd_db;
+    const char* shadow_db;
+    int open_flags;                 /* SQLITE_OPEN_* flags added to
+                                       SQLITE_OPEN_READONLY */
+    sqlite3_int64 mmap_size;        /* PRAGMA mmap_size, -1 for SQLite's */
+    int sqlite_cache_size;          /* PRAGMA cache_size, 0 for SQLite's */
+    sqlite3_int64 memory_max;       /* DBs up to this size are copied
+                                       in memory */
+    int cache_size;                 /* records kept in the cache */
+    int stale_grace;                /* seconds cached records may be
+                                       served, 0 disables the cache */
+    int open_backoff;
+    int enumerate;                  /* set/get/endXXent allowed */
+    int query_deadline;             /* milliseconds, 0 for none */
+    int deadlines[QUERY_COUNT];     /* per query, -1 if not set */
+    const char* stats;              /* counters file, NULL for none */
+    const char* homedir;            /* templates of NULL homedirs... */
+    const char* shell;              /* ... and shells */
+    sqlite3_int64 min_uid, max_uid; /* ids looked up, -1 if unbounded */
+    sqlite3_int64 min_gid, max_gid;
+    const char* user_prefixes;      /* names looked up start with one of
+                                       these, NULL if any name can */
+    const char* group_prefixes;
+    int ignore_members;             /* group entries have no members */
+    const char* ignore_members_of;  /* groups whose entries have none */
+    unsigned generation;            /* changed on every reload */
+    int refs;                       /* settings_acquire references, plus
+                                       one while in use */
+};
+
+const struct nss_settings* settings_acquire(void);
+void settings_release(const struct nss_settings*);
+void settings_check(void);
+int settings_ignore_members(const char*);
+
+#endif
@@ -21,6 +21,9 @@
  */
 
 #include "nss-sqlite.h"
+#include "cache.h"
+#include "db.h"
+#include "settings.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -44,40 +47,72 @@ static struct {
                             to getspent_r */
     /* user information cache used if NSS_TRYAGAIN was returned */
     struct spwd entry;
+    int deadline;       /* nss_queries deadline of the query */
+    int layer;          /* layer and shard being enumerated */
+    int shard;
 } spent_data = { NULL, NULL, 0, NULL};
 
 /* mutex used to serialize xxspent operation */
 pthread_mutex_t spent_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 
+/*
+ * Open the connection enumerating a part (see db_part) of the shadow DB,
+ * spent_mutex being held.
+ * @param layer Layer number, 0 if the DB isn't layered.
+ * @param shard Shard number, 0 if the layer isn't sharded.
+ * @return NSS_STATUS_NOTFOUND past the last part.
+ */
+static enum nss_status spent_open(int layer, int shard) {
+    struct nss_db* db;
+    char* sql;
+    int res = db_part(&shadow_db, &layer, &shard, &db);
+
+    if(res != NSS_STATUS_SUCCESS) {
+        spent_data.pDb = NULL;
+        return res;
+    }
+    NSS_DEBUG("setspent: opening DB connection to %s\n", db->path);
+    if(open_db(db->path, &spent_data.pDb) != SQLITE_OK) {
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(!(sql = get_query(spent_data.pDb, QUERY_SETSPENT, &spent_data.deadline)) ) {
+        NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
+        sqlite3_close(spent_data.pDb);
+        spent_data.pDb = NULL;
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(sqlite3_prepare(spent_data.pDb, sql, -1, &spent_data.pSt, NULL) != SQLITE_OK) {
+        NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
+        sqlite3_finalize(spent_data.pSt);
+        sqlite3_close(spent_data.pDb);
+        spent_data.pDb = NULL;
+        free(sql);
+        return NSS_STATUS_UNAVAIL;
+    }
+    free(sql);
+    spent_data.layer = layer;
+    spent_data.shard = shard;
+    return NSS_STATUS_SUCCESS;
+}
+
 /**
  * Setup everything needed to retrieve shadow entries.
  */
 enum nss_status _nss_sqlite_setspent(void) {
-    char* sql;
+    enum nss_status res = NSS_STATUS_SUCCESS;
     pthread_mutex_lock(&spent_mutex);
     if(spent_data.pDb == NULL) {
-        NSS_DEBUG("setspent: opening DB connection\n");
-        if(sqlite3_open(NSS_SQLITE_SHADOW_DB, &spent_data.pDb) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(!(sql = get_query(spent_data.pDb, "setspent")) ) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            sqlite3_close(spent_data.pDb);
-            return NSS_STATUS_UNAVAIL;
-        }
-        if(sqlite3_prepare(spent_data.pDb, sql, -1, &spent_data.pSt, NULL) != SQLITE_OK) {
-            NSS_ERROR(sqlite3_errmsg(spent_data.pDb));
-            sqlite3_finalize(spent_data.pSt);
-            sqlite3_close(spent_data.pDb);
-            free(sql);
-            return NSS_STATUS_UNAVAIL;
-        }
+        /* enumerations can be disabled by the settings */
+        const struct nss_settings* s;
+
+        settings_check();
+        s = settings_acquire();
+        res = s->enumerate ? spent_open(0, 0) : NSS_STATUS_NOTFOUND;
+        settings_release(s);
     }
-    free(sql);
     pthread_mutex_unlock(&spent_mutex);
-    return NSS_STATUS_SUCCESS;
+    return res;
 }
 
 /*
@@ -113,7 +148,12 @@ _nss_sqlite_getspent_r(struct spwd *spbuf, char *buf,
     pthread_mutex_lock(&spent_mutex);
 
     if(spent_data.pDb == NULL) {
-        _nss_sqlite_setspent();
+        res = _nss_sqlite_setspent();
+        if(spent_data.pDb == NULL) {
+            pthread_mutex_unlock(&spent_mutex);
+            /* nothing to enumerate */
+            return (res == NSS_STATUS_NOTFOUND) ? res : NSS_STATUS_UNAVAIL;
+        }
     }
 
     if(spent_data.try_again) {
@@ -126,14 +166,28 @@ _nss_sqlite_getspent_r(struct spwd *spbuf, char *buf,
         }
     }
 
-    res = res2nss_status(sqlite3_step(spent_data.pSt), spent_data.pDb, spent_data.pSt);
-    if(res != NSS_STATUS_SUCCESS) {
-        spent_data.pDb = NULL;
-        pthread_mutex_unlock(&spent_mutex);
-        return res;
-    }
-
-    fill_shadow_sql(&spent_data.entry, spent_data.pSt);
+    do {
+        deadline_start(spent_data.pDb, QUERY_SETSPENT, spent_data.deadline);
+        res = res2nss_status(sqlite3_step(spent_data.pSt), spent_data.pDb, spent_data.pSt);
+        while(res == NSS_STATUS_NOTFOUND) {
+            /* go on with the next part */
+            int next = spent_open(spent_data.layer, spent_data.shard + 1);
+            if(next != NSS_STATUS_SUCCESS) {
+                res = (next == NSS_STATUS_NOTFOUND) ? res : next;
+                break;
+            }
+            deadline_start(spent_data.pDb, QUERY_SETSPENT, spent_data.deadline);
+            res = res2nss_status(sqlite3_step(spent_data.pSt), spent_data.pDb, spent_data.pSt);
+        }
+        if(res != NSS_STATUS_SUCCESS) {
+            spent_data.pDb = NULL;
+            pthread_mutex_unlock(&spent_mutex);
+            return res;
+        }
+        fill_shadow_sql(&spent_data.entry, spent_data.pSt);
+        /* users overridden by a previous layer were already returned */
+    } while(spent_data.layer > 0
+            && db_shadowed(&shadow_db, spent_data.layer, QUERY_GETSPNAM, spent_data.entry.sp_namp));
     res = fill_shadow(spbuf, buf, buflen, spent_data.entry, errnop);
 
     NSS_DEBUG("getspent_r: fetched user %s\n", spent_data.entry.sp_namp);
@@ -156,58 +210,55 @@ _nss_sqlite_getspent_r(struct spwd *spbuf, char *buf,
  * Get shadow information using username.
  */
 
-enum nss_status _nss_sqlite_getspnam_r(const char* name, struct spwd *spbuf,
+static enum nss_status getspnam_db(struct nss_db* db, const char* name, struct spwd *spbuf,
                char *buf, size_t buflen, int *errnop) {
-    sqlite3 *pDb;
     struct sqlite3_stmt* pSquery;
     int res;
     struct spwd entry;
-    char* query;
 
     NSS_DEBUG("getspnam_r: looking for user %s (shadow)\n", name);
 
-    if(sqlite3_open(NSS_SQLITE_SHADOW_DB, &pDb) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    res = db_acquire_key(&db, QUERY_GETSPNAM, name, 0, &pSquery);
+    if(res != NSS_STATUS_SUCCESS) {
+        return res;
     }
 
-    if(!(query = get_query(pDb, "getspnam_r")) ) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        sqlite3_close(pDb);
+    if(db_bind_name(pSquery, name) != SQLITE_OK) {
+        NSS_DEBUG(sqlite3_errmsg(db->pDb));
+        db_release(db, pSquery);
         return NSS_STATUS_UNAVAIL;
     }
 
-
-    if(sqlite3_prepare(pDb, query, strlen(query), &pSquery, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return FALSE;
-    }
-
-    if(sqlite3_bind_text(pSquery, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        NSS_DEBUG(sqlite3_errmsg(pDb));
-        free(query);
-        sqlite3_finalize(pSquery);
-        sqlite3_close(pDb);
-        return NSS_STATUS_UNAVAIL;
+    res = db_step(db, pSquery);
+    if(res == NSS_STATUS_SUCCESS) {
+        fill_shadow_sql(&entry, pSquery);
+        res = fill_shadow(spbuf, buf, buflen, entry, errnop);
     }
 
+    db_release(db, pSquery);
+    return res;
+}
 
-    res = res2nss_status(sqlite3_step(pSquery), pDb, pSquery);
-    if(res != NSS_STATUS_SUCCESS) {
-        free(query);
-        return res;
+/*
+ * getspnam_r entry point, falls back on the last known good record
+ * when the DB can't be used.
+ */
+enum nss_status _nss_sqlite_getspnam_r(const char* name, struct spwd *spbuf,
+               char *buf, size_t buflen, int *errnop) {
+    struct nss_db* db;
+    int err = 0, i;
+    enum nss_status res;
+
+    /* the first layer knowing the user wins */
+    for(i = 0 ; (res = db_layer(&shadow_db, i, &db)) == NSS_STATUS_SUCCESS ; ++i) {
+        res = getspnam_db(db, name, spbuf, buf, buflen, &err);
+        if(res != NSS_STATUS_NOTFOUND) {
+            break;
+        }
+    }
+    res = cache_shadow(CACHE_SPNAM, name, 0, res, spbuf, buf, buflen, &err);
+    if(err != 0) {
+        *errnop = err;
     }
-
-    fill_shadow_sql(&entry, pSquery);
-    res = fill_shadow(spbuf, buf, buflen, entry, errnop);
-
-    free(query);
-    sqlite3_finalize(pSquery);
-    sqlite3_close(pDb);
-
     return res;
 }
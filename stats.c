@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * stats.c : Per process counters.
+ */
+
+#include "nss-sqlite.h"
+#include "settings.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+struct nss_sqlite_stats nss_stats;
+
+/*
+ * Append counters to the file named by NSS_SQLITE_STATS, or else by the
+ * stats setting, if any, when the process exits. secure_getenv keeps
+ * setuid programs from being tricked into writing anywhere.
+ */
+static void __attribute__((destructor)) stats_dump(void) {
+    const struct nss_settings* s = settings_acquire();
+    const char* path = secure_getenv("NSS_SQLITE_STATS");
+    FILE* out;
+    int i;
+
+    if(path == NULL) {
+        path = s->stats;
+    }
+    out = (path != NULL) ? fopen(path, "a") : NULL;
+    settings_release(s);
+    if(out == NULL) {
+        return;
+    }
+
+    fprintf(out, "pid=%d stale_serves=%lu open_skips=%lu log_suppressed=%lu memory_loads=%lu replica_copies=%lu key_rejects=%lu intern_saved=%lu",
+            getpid(), nss_stats.stale_serves, nss_stats.open_skips, nss_stats.log_suppressed,
+            nss_stats.memory_loads, nss_stats.replica_copies, nss_stats.key_rejects,
+            nss_stats.intern_saved);
+    for(i = 0 ; i < QUERY_COUNT ; ++i) {
+        if(nss_stats.deadline_hits[i] > 0) {
+            fprintf(out, " deadline_hits.%s=%lu", query_names[i], nss_stats.deadline_hits[i]);
+        }
+    }
+    for(i = 0 ; i < QUERY_COUNT ; ++i) {
+        if(nss_stats.overridden[i]) {
+            fprintf(out, " overridden.%s=1", query_names[i]);
+        }
+    }
+    fprintf(out, "\n");
+    fclose(out);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_STATS_H
+#define NSS_SQLITE_STATS_H
+
+#include "utils.h"
+
+/*
+ * Per process counters. They are dumped when the process exits if the
+ * NSS_SQLITE_STATS environment variable or the stats setting names a
+ * file to append to.
+ */
+struct nss_sqlite_stats {
+    unsigned long stale_serves;     /* records served from the cache
+                                       while the DB was unusable */
+    unsigned long open_skips;       /* opens not attempted because the
+                                       DB failed to open recently */
+    unsigned long log_suppressed;   /* rate limited error messages */
+    unsigned long memory_loads;     /* DB copied in memory */
+    unsigned long replica_copies;   /* replica refreshed from its source */
+    unsigned long key_rejects;      /* lookups not run, their key being
+                                       outside of the DB keys */
+    unsigned long intern_saved;     /* bytes the cache saves by sharing
+                                       the strings of its records */
+    unsigned long deadline_hits[QUERY_COUNT];   /* statements aborted
+                                                   by their deadline */
+    int overridden[QUERY_COUNT];    /* queries nss_queries overrides */
+};
+
+extern struct nss_sqlite_stats nss_stats;
+
+#define STATS_INC(counter) __sync_fetch_and_add(&nss_stats.counter, 1)
+
+#endif
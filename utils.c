@@ -21,50 +21,391 @@
  */
 
 #include "nss-sqlite.h"
+#include "functions.h"
+#include "settings.h"
+#include "stats.h"
+#include "utils.h"
+#include "vfs.h"
 
+#include <endian.h>
 #include <errno.h>
 #include <grp.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <shadow.h>
 #include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
+/*
+ * Remembered open failure of a database. While it holds, opening this
+ * database fails right away, without touching the file nor syslog.
+ */
+struct open_failure {
+    struct open_failure* next;
+    int failed;
+    int code;               /* SQLite result of the failed open */
+    int err;                /* errno of the failed open */
+    time_t retry;           /* time after which open is tried again */
+    time_t backoff;         /* current delay between two tries */
+    time_t checked;         /* last time the file was stat'ed */
+    int stat_err;           /* stat result when open failed... */
+    struct stat st;         /* ... and file identity */
+    char path[];
+};
+
+/* One entry per database path ever opened, added on first open */
+static struct open_failure* open_failures = NULL;
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
 
-/* Query the DB itself for the SQL query that is needed to resolve the call to getent function
- * @param pDb Database handle, will be closed if something fails.
- * @param getent_function The name of the getent function for which SQL statement is going to be retrieved.
+/*
+ * stat a file, returning 0 or errno.
  */
-char *get_query(struct sqlite3* pDb, char *getent_function) {
-    struct sqlite3_stmt* pSsql;
-    const char* sql = "SELECT query FROM nss_queries WHERE name = ?";
-    char *query;
+static int stat_file(const char* path, struct stat* st) {
+    return stat(path, st) == 0 ? 0 : errno;
+}
+
+/*
+ * Tell if a file changed since an open failure was recorded.
+ */
+static int file_changed(struct open_failure* f) {
+    struct stat st;
+    int err = stat_file(f->path, &st);
+
+    if(err != f->stat_err) {
+        return TRUE;
+    }
+    return err == 0 && (st.st_dev != f->st.st_dev || st.st_ino != f->st.st_ino
+            || st.st_mode != f->st.st_mode || st.st_uid != f->st.st_uid
+            || st.st_gid != f->st.st_gid || st.st_mtime != f->st.st_mtime
+            || st.st_ctime != f->st.st_ctime);
+}
+
+/*
+ * Find the open failure entry of a database, open_mutex being held.
+ * @return Entry, NULL if out of memory.
+ */
+static struct open_failure* open_failure(const char* path) {
+    struct open_failure* f;
+
+    for(f = open_failures ; f != NULL ; f = f->next) {
+        if(strcmp(f->path, path) == 0) {
+            return f;
+        }
+    }
+    if((f = calloc(1, sizeof(*f) + strlen(path) + 1)) == NULL) {
+        return NULL;
+    }
+    strcpy(f->path, path);
+    f->next = open_failures;
+    open_failures = f;
+    return f;
+}
+
+/*
+ * Open a database read only.
+ * Failures are remembered: until a backoff (doubling up to the
+ * open_backoff setting) expires or the file changes, later
+ * calls fail immediately and are not logged again.
+ * @param path Database file.
+ * @param ppDb Will point to the opened handle, NULL on failure.
+ * @return SQLite result code.
+ */
+int open_db(const char* path, struct sqlite3** ppDb) {
+    const struct nss_settings* s = settings_acquire();
+    struct open_failure* f = NULL;
+    int flags = SQLITE_OPEN_READONLY | s->open_flags;
+    sqlite3_int64 mmap_size = s->mmap_size;
+    int cache_size = s->sqlite_cache_size;
+    int open_backoff = s->open_backoff;
+    char pragma[64];
+    time_t t;
     int res;
 
+    settings_release(s);
+    *ppDb = NULL;
+    pthread_mutex_lock(&open_mutex);
+    f = open_failure(path);
+
+    if(f != NULL && f->failed) {
+        t = monotonic_now();
+        /* Only stat once a second while backing off */
+        if(t < f->retry && (t == f->checked || !file_changed(f))) {
+            f->checked = t;
+            res = f->code;
+            pthread_mutex_unlock(&open_mutex);
+            STATS_INC(open_skips);
+            return res;
+        }
+        f->checked = t;
+    }
+    pthread_mutex_unlock(&open_mutex);
+
+#if defined(NSS_SQLITE_ZSTD_VFS)
+    /* packed DBs, others go through the mmap VFS if enabled */
+    res = sqlite3_open_v2(path, ppDb, flags, zstd_vfs_name());
+#elif defined(NSS_SQLITE_MMAP_VFS)
+    res = sqlite3_open_v2(path, ppDb, flags, mmap_vfs_name());
+#else
+    res = sqlite3_open_v2(path, ppDb, flags, NULL);
+#endif
+    if(res == SQLITE_OK && mmap_size >= 0) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lld", (long long)mmap_size);
+        sqlite3_exec(*ppDb, pragma, NULL, NULL, NULL);
+    }
+    if(res == SQLITE_OK && cache_size != 0) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = %d", cache_size);
+        sqlite3_exec(*ppDb, pragma, NULL, NULL, NULL);
+    }
+    if(res == SQLITE_OK && (res = register_functions(*ppDb)) != SQLITE_OK) {
+        NSS_ERROR("Unable to register SQL functions on %s: %s\n", path, sqlite3_errmsg(*ppDb));
+        sqlite3_close(*ppDb);
+        *ppDb = NULL;
+        return res;
+    }
+    if(res == SQLITE_OK) {
+        pthread_mutex_lock(&open_mutex);
+        if(f != NULL && f->failed) {
+            NSS_DEBUG("open_db: %s is available again\n", path);
+            f->failed = FALSE;
+        }
+        pthread_mutex_unlock(&open_mutex);
+        return res;
+    }
+
+    pthread_mutex_lock(&open_mutex);
+    if(f == NULL) {
+        NSS_ERROR("Unable to open %s: %s\n", path, sqlite3_errmsg(*ppDb));
+    } else {
+        int err = sqlite3_system_errno(*ppDb);
+        if(!f->failed || f->code != res || f->err != err) {
+            NSS_ERROR("Unable to open %s: %s\n", path, sqlite3_errmsg(*ppDb));
+            f->backoff = 0;
+        }
+        f->failed = TRUE;
+        f->code = res;
+        f->err = err;
+        f->stat_err = stat_file(path, &f->st);
+        f->backoff = (f->backoff == 0) ? 1 : f->backoff * 2;
+        if(f->backoff > open_backoff) {
+            f->backoff = open_backoff;
+        }
+        f->checked = monotonic_now();
+        f->retry = f->checked + f->backoff;
+    }
+    pthread_mutex_unlock(&open_mutex);
+
+    sqlite3_close(*ppDb);
+    *ppDb = NULL;
+    return res;
+}
+
+
+const char* query_names[QUERY_COUNT] = {
+    "setpwent",
+    "getpwnam_r",
+    "getpwuid_r",
+    "setgrent",
+    "getgrnam_r",
+    "getgrgid_r",
+    "initgroups_dyn",
+    "get_users",
+    "setspent",
+    "getspnam_r"
+};
+
+/*
+ * Queries used when nss_queries doesn't override them, as shipped in
+ * conf/passwd.sql and conf/shadow.sql.
+ */
+const char* default_queries[QUERY_COUNT] = {
+    "SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd;",
+    "SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd WHERE username = ?",
+    "SELECT username, passwd, uid, gid, gecos, homedir, shell FROM passwd WHERE uid = ?",
+    "SELECT gid, groupname, passwd FROM groups",
+    "SELECT gid, groupname, passwd FROM groups WHERE groupname = ?",
+    "SELECT gid, groupname, passwd FROM groups WHERE gid = ?",
+    "SELECT ug.gid FROM user_group ug INNER JOIN passwd p ON p.uid = ug.uid WHERE p.username = ? AND ug.gid != ?",
+    "SELECT username FROM passwd u INNER JOIN user_group ug ON ug.uid = u.uid WHERE ug.gid = ?",
+    "SELECT username, passwd, lastchange, mindays, maxdays, warn, inact, expire FROM shadow",
+    "SELECT username, passwd, lastchange, mindays, maxdays, warn, inact, expire FROM shadow WHERE username = ?"
+};
+
+/* Deadline of the query the current thread runs */
+static __thread struct nss_deadline deadline;
+
+/*
+ * Deadline of a query: from the settings if set for this query, then
+ * from nss_queries (ms, -1 if it doesn't give one), then the default one
+ * of the settings.
+ */
+static int query_deadline(enum nss_query query, int ms) {
+    const struct nss_settings* s = settings_acquire();
+    int res = s->deadlines[query];
+
+    if(res < 0) {
+        res = (ms >= 0) ? ms : s->query_deadline;
+    }
+    settings_release(s);
+    return res;
+}
+
+/*
+ * Progress handler aborting statements once the deadline is reached.
+ */
+static int deadline_check(void* unused) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec < deadline.expires.tv_sec
+            || (now.tv_sec == deadline.expires.tv_sec && now.tv_nsec < deadline.expires.tv_nsec)) {
+        return 0;
+    }
+
+    if(!deadline.hit) {
+        deadline.hit = TRUE;
+        STATS_INC(deadline_hits[deadline.query]);
+        NSS_ERROR("%s query exceeded its %d ms deadline, aborting\n",
+                query_names[deadline.query], deadline.ms);
+    }
+    return 1;
+}
+
+/*
+ * Bound the time statements run on a connection may take, from now on,
+ * to the deadline of a query. Aborted statements fail with SQLITE_INTERRUPT,
+ * which makes the lookup return NSS_STATUS_UNAVAIL.
+ * @param pDb Database handle.
+ * @param query Query about to be run.
+ * @param ms Deadline the nss_queries table of the DB gives to the query,
+ *      -1 if none.
+ */
+void deadline_start(struct sqlite3* pDb, enum nss_query query, int ms) {
+    ms = query_deadline(query, ms);
+
+    if(ms <= 0) {
+        deadline_stop(pDb);
+        return;
+    }
+
+    deadline.query = query;
+    deadline.ms = ms;
+    deadline.hit = FALSE;
+    clock_gettime(CLOCK_MONOTONIC, &deadline.expires);
+    deadline.expires.tv_sec += ms / 1000;
+    deadline.expires.tv_nsec += (ms % 1000) * 1000000L;
+    if(deadline.expires.tv_nsec >= 1000000000L) {
+        deadline.expires.tv_sec++;
+        deadline.expires.tv_nsec -= 1000000000L;
+    }
+    sqlite3_progress_handler(pDb, NSS_DEADLINE_STEPS, deadline_check, NULL);
+}
+
+/*
+ * Let statements run on a connection without deadline.
+ */
+void deadline_stop(struct sqlite3* pDb) {
+    deadline.ms = 0;
+    sqlite3_progress_handler(pDb, 0, NULL, NULL);
+}
+
+/*
+ * Save the deadline of the running query before starting a nested one.
+ */
+void deadline_save(struct nss_deadline* saved) {
+    *saved = deadline;
+}
+
+/*
+ * Go on with the deadline of a query once a nested one is done.
+ * @param pDb Connection the query runs on.
+ * @param saved Deadline saved by deadline_save.
+ */
+void deadline_restore(struct sqlite3* pDb, const struct nss_deadline* saved) {
+    deadline = *saved;
+    sqlite3_progress_handler(pDb, (deadline.ms > 0) ? NSS_DEADLINE_STEPS : 0,
+            (deadline.ms > 0) ? deadline_check : NULL, NULL);
+}
+
+/*
+ * Extract the columns of a nss_queries row.
+ * @param pSt Statement positioned on a "SELECT * FROM nss_queries" row.
+ * @param name Will point to the query name.
+ * @param text Will point to the SQL text.
+ * @param ms Will be filled with the deadline column, or -1 if there is
+ *      none.
+ */
+void read_query_row(struct sqlite3_stmt* pSt, const char** name, const char** text, int* ms) {
+    int i;
+
+    *name = NULL;
+    *text = NULL;
+    *ms = -1;
+    for(i = 0 ; i < sqlite3_column_count(pSt) ; ++i) {
+        const char* column = sqlite3_column_name(pSt, i);
+        if(strcmp(column, "name") == 0) {
+            *name = (const char*)sqlite3_column_text(pSt, i);
+        } else if(strcmp(column, "query") == 0) {
+            *text = (const char*)sqlite3_column_text(pSt, i);
+        } else if(strcmp(column, "deadline") == 0 && sqlite3_column_type(pSt, i) != SQLITE_NULL) {
+            *ms = sqlite3_column_int(pSt, i);
+        }
+    }
+}
+
+/* Get the SQL query that is needed to resolve the call to getent function, from
+ * the nss_queries table if it overrides the compiled in one.
+ * The query deadline is started, using the deadline column of nss_queries if there is one.
+ * @param pDb Database handle, left open even if something fails.
+ * @param query The getent function for which SQL statement is going to be retrieved.
+ * @param ms Will be filled with the deadline column, or -1 if there is
+ *      none.
+ */
+char *get_query(struct sqlite3* pDb, enum nss_query query, int* ms) {
+    struct sqlite3_stmt* pSsql;
+    const char* sql = "SELECT * FROM nss_queries WHERE name = ?";
+    const char* name;
+    const char* text = NULL;
+
+    *ms = -1;
     if(sqlite3_prepare(pDb, sql, -1, &pSsql, NULL) != SQLITE_OK) {
-        NSS_ERROR(sqlite3_errmsg(pDb));
         sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
-        return NULL;
+        return strdup(default_queries[query]);
     }
 
-    if(sqlite3_bind_text(pSsql, 1, getent_function, -1, SQLITE_STATIC) != SQLITE_OK) {
+    if(sqlite3_bind_text(pSsql, 1, query_names[query], -1, SQLITE_STATIC) != SQLITE_OK) {
         NSS_DEBUG(sqlite3_errmsg(pDb));
         sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
         return NULL;
     }
 
-    res = res2nss_status(sqlite3_step(pSsql), pDb, pSsql);
-    if(res != NSS_STATUS_SUCCESS) {
-        sqlite3_finalize(pSsql);
-        sqlite3_close(pDb);
-        return NULL;
+    switch(sqlite3_step(pSsql)) {
+        case SQLITE_ROW:
+            read_query_row(pSsql, &name, &text, ms);
+            break;
+        case SQLITE_DONE:
+            break;
+        default:
+            NSS_ERROR(sqlite3_errmsg(pDb));
+            sqlite3_finalize(pSsql);
+            return NULL;
     }
+    deadline_start(pDb, query, *ms);
 
-    query = strdup(sqlite3_column_text(pSsql, 0));
+    text = strdup((text != NULL) ? text : default_queries[query]);
     sqlite3_finalize(pSsql);
-    return query;
+    return (char*)text;
 }
 
 /*
@@ -100,19 +441,22 @@ enum nss_status res2nss_status(int res, struct sqlite3* pDb, struct sqlite3_stmt
 
 /*
  * Fill a group struct using given information.
- * @param pDb Handle to a database used to fetch group's members.
+ * @param db Database used to fetch group's members.
  * @param gbuf Struct which will be filled with various info.
  * @param buf Buffer which will contain all strings pointed to by
  *      gbuf.
  * @param buflen Buffer length.
- * @param name Groupname.
- * @param pw Group password.
- * @param gid Group ID.
+ * @param entry Group entry with needed data. If entry.gr_mem is not NULL,
+ *      members are copied from it instead of being fetched from pDb.
+ *      Groups whose members are ignored (see settings) get none.
+ * @param members Comma separated member list returned along with the
+ *      group, NULL if the query didn't return one.
  * @param errnop Pointer to errno, will be filled if something goes
  *      wrong.
  */
 
-enum nss_status fill_group(struct sqlite3 *pDb, struct group *gbuf, char* buf, size_t buflen, struct group entry, int *errnop) {
+enum nss_status fill_group(struct nss_db *db, struct group *gbuf, char* buf, size_t buflen, struct group entry,
+                           const char* members, int *errnop) {
     int name_length = strlen((char*)entry.gr_name) + 1;
     int pw_length = strlen((char*)entry.gr_passwd) + 1;
     int total_length = name_length + pw_length;
@@ -133,8 +477,21 @@ enum nss_status fill_group(struct sqlite3 *pDb, struct group *gbuf, char* buf, s
     gbuf->gr_passwd = buf;
     buf += pw_length;
 
-    /* We have a group, we now need to fetch its users */
-    res = get_users(pDb, gbuf->gr_gid, buf, buflen - total_length, errnop);
+    /* We have a group, we now need its users: either already known
+     * (entry coming from the cache or the group query) or fetched from the DB */
+    if(settings_ignore_members(gbuf->gr_name)) {
+        res = copy_members(NULL, 0, buf, buflen - total_length, errnop);
+    } else if(entry.gr_mem != NULL) {
+        int count = 0;
+        while(entry.gr_mem[count] != NULL) {
+            ++count;
+        }
+        res = copy_members(entry.gr_mem, count, buf, buflen - total_length, errnop);
+    } else if(members != NULL) {
+        res = split_members(members, buf, buflen - total_length, errnop);
+    } else {
+        res = get_users(db, gbuf->gr_gid, buf, buflen - total_length, errnop);
+    }
     if(res == NSS_STATUS_SUCCESS) {
         gbuf->gr_mem = (char**)buf;
     }
@@ -142,15 +499,179 @@ enum nss_status fill_group(struct sqlite3 *pDb, struct group *gbuf, char* buf, s
     return res;
 }
 
-inline void fill_group_sql(struct group* entry, struct sqlite3_stmt* pSquery) {
+/*
+ * Fill a group entry from a group query row.
+ * @param entry Entry to fill.
+ * @param members Will point to the member list if the query returns one
+ *      as 4th column (e.g. using group_concat), NULL otherwise.
+ * @param pSquery Statement positioned on the row.
+ */
+void fill_group_sql(struct group* entry, const char** members, struct sqlite3_stmt* pSquery) {
     entry->gr_gid = sqlite3_column_int(pSquery, 0);
     entry->gr_name = sqlite3_column_text(pSquery, 1);
     entry->gr_passwd = sqlite3_column_text(pSquery, 2);
+    entry->gr_mem = NULL;
+
+    *members = NULL;
+    if(sqlite3_column_count(pSquery) > 3) {
+        /* group_concat over no member yields NULL */
+        *members = (const char*)sqlite3_column_text(pSquery, 3);
+        if(*members == NULL) {
+            *members = "";
+        }
+    }
 
     return;
 }
 
+/*
+ * Count occurences of c in s[0..len), 16 or 32 bytes at a time when the
+ * CPU allows it.
+ */
+#ifdef __SSE2__
+#include <immintrin.h>
+
+static size_t count_char_sse2(const char* s, size_t len, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t count = 0, i = 0;
+
+    for( ; i + 16 <= len ; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    }
+    for( ; i < len ; ++i) {
+        count += (s[i] == c);
+    }
+    return count;
+}
+
+#ifdef __x86_64__
+static __attribute__((target("avx2"))) size_t count_char_avx2(const char* s, size_t len, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t count = 0, i = 0;
+
+    for( ; i + 32 <= len ; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(s + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+    }
+    return count + count_char_sse2(s + i, len - i, c);
+}
+#endif
+#endif
+
+static size_t count_char(const char* s, size_t len, char c) {
+#ifdef __SSE2__
+#ifdef __x86_64__
+    if(__builtin_cpu_supports("avx2")) {
+        return count_char_avx2(s, len, c);
+    }
+#endif
+    return count_char_sse2(s, len, c);
+#else
+    size_t count = 0, i;
+    for(i = 0 ; i < len ; ++i) {
+        count += (s[i] == c);
+    }
+    return count;
+#endif
+}
+
+/*
+ * Same as copy_members, members being given as a comma separated list.
+ * @param list Member list, empty if the group has no member.
+ * @param buffer Buffer which will contain members' names headed with
+ * a char* pointers area, ending by NULL.
+ * @param buflen Buffer length.
+ * @param errnop Pointer to errno, will be filled if an error occurs.
+ */
+enum nss_status split_members(const char* list, char* buffer, size_t buflen, int* errnop) {
+    size_t len = strlen(list);
+    size_t mcount = (len > 0) ? count_char(list, len, ',') + 1 : 0;
+    size_t ptr_area_size = (mcount + 1) * sizeof(char*);
+    char **ptr_area = (char**)buffer;
+    char *next_member, *end, *stop;
+    size_t i;
+
+    if(buflen < ptr_area_size + len + 1) {
+        (*errnop) = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    /* Copy the whole list at once then cut it at each comma */
+    next_member = buffer + ptr_area_size;
+    stop = next_member + len;
+    memcpy(next_member, list, len + 1);
+    for(i = 0 ; i < mcount ; ++i) {
+        ptr_area[i] = next_member;
+        end = memchr(next_member, ',', stop - next_member);
+        if(end != NULL) {
+            *end = '\0';
+            next_member = end + 1;
+        }
+    }
+    ptr_area[i] = NULL;
+    return NSS_STATUS_SUCCESS;
+}
+
+
+
+/*
+ * Copy a homedir or shell, or expand the template of the settings when
+ * the DB doesn't give any: %u is replaced by the user name, %U by the
+ * uid, %g by the gid and %% by %.
+ * @param out Buffer, NULL to only get the length.
+ * @param value Homedir or shell, NULL if the template is used.
+ * @param template Template.
+ * @param entry User.
+ * @return Length including the terminating NUL.
+ */
+static size_t copy_or_expand(char* out, const char* value, const char* template, const struct passwd* entry) {
+    char number[24];
+    const char* part;
+    size_t len = 0, l;
+
+    if(value != NULL) {
+        len = strlen(value) + 1;
+        if(out != NULL) {
+            memcpy(out, value, len);
+        }
+        return len;
+    }
 
+    for( ; *template != '\0' ; template += (*template == '%' && template[1] != '\0') ? 2 : 1) {
+        part = template;
+        l = 1;
+        if(*template == '%') {
+            switch(template[1]) {
+                case 'u':
+                    part = entry->pw_name;
+                    l = strlen(part);
+                    break;
+                case 'U':
+                case 'g':
+                    l = snprintf(number, sizeof(number), "%lu",
+                            (unsigned long)((template[1] == 'U') ? entry->pw_uid : entry->pw_gid));
+                    part = number;
+                    break;
+                case '%':
+                    l = 1;
+                    break;
+                default:
+                    /* copied as is */
+                    l = (template[1] != '\0') ? 2 : 1;
+                    break;
+            }
+        }
+        if(out != NULL) {
+            memcpy(out + len, part, l);
+        }
+        len += l;
+    }
+    if(out != NULL) {
+        out[len] = '\0';
+    }
+    return len + 1;
+}
 
 /*
  * Fill a passwd struct using given information.
@@ -158,20 +679,23 @@ inline void fill_group_sql(struct group* entry, struct sqlite3_stmt* pSquery) {
  * @param buf Buffer which will contain all strings pointed to by
  *      pwbuf.
  * @param buflen Buffer length.
- * @param entry Passwd entry with needed data.
+ * @param entry Passwd entry with needed data. A NULL homedir or shell is
+ *      given by the homedir or shell setting.
  * @param errnop Pointer to errno, will be filled if something goes wrong.
  */
 
 enum nss_status fill_passwd(struct passwd* pwbuf, char* buf, size_t buflen, struct passwd entry, int* errnop) {
+    const struct nss_settings* s = settings_acquire();
     int name_length = strlen(entry.pw_name) + 1;
     int pw_length = strlen(entry.pw_passwd) + 1;
     int gecos_length = strlen(entry.pw_gecos) + 1;
-    int homedir_length = strlen(entry.pw_dir) + 1;
-    int shell_length = strlen(entry.pw_shell) + 1;
+    int homedir_length = copy_or_expand(NULL, entry.pw_dir, s->homedir, &entry);
+    int shell_length = copy_or_expand(NULL, entry.pw_shell, s->shell, &entry);
 
     int total_length = name_length + pw_length + gecos_length + shell_length + homedir_length;
 
     if(buflen < total_length) {
+        settings_release(s);
         *errnop = ERANGE;
         return NSS_STATUS_TRYAGAIN;
     }
@@ -191,12 +715,13 @@ enum nss_status fill_passwd(struct passwd* pwbuf, char* buf, size_t buflen, stru
     pwbuf->pw_gecos = buf;
     buf += gecos_length;
 
-    strcpy(buf, entry.pw_dir);
+    copy_or_expand(buf, entry.pw_dir, s->homedir, &entry);
     pwbuf->pw_dir = buf;
     buf += homedir_length;
 
-    strcpy(buf, entry.pw_shell);
+    copy_or_expand(buf, entry.pw_shell, s->shell, &entry);
     pwbuf->pw_shell = buf;
+    settings_release(s);
 
 
     return NSS_STATUS_SUCCESS;
@@ -215,6 +740,153 @@ inline void fill_passwd_sql(struct passwd* entry, struct sqlite3_stmt* pSquery)
 }
 
 
+static uint32_t get32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+/*
+ * Check a packed record's strings area and offsets.
+ * @return Strings area length, 0 if malformed.
+ */
+static size_t check_packed(const unsigned char* record, size_t len, size_t header, const unsigned char* offsets, int count) {
+    size_t strings;
+    int i;
+
+    if(len <= header || record[len - 1] != '\0') {
+        return 0;
+    }
+    strings = len - header;
+    for(i = 0 ; i < count ; ++i) {
+        if(get32(offsets + i * 4) >= strings) {
+            return 0;
+        }
+    }
+    return strings;
+}
+
+/*
+ * Expand a template after the strings of a packed record.
+ */
+static enum nss_status expand_packed(char** field, const char* template, const struct passwd* pwbuf,
+                                     char** buf, size_t* buflen, int* errnop) {
+    size_t len = copy_or_expand(NULL, NULL, template, pwbuf);
+
+    if(*buflen < len) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    copy_or_expand(*buf, NULL, template, pwbuf);
+    *field = *buf;
+    *buf += len;
+    *buflen -= len;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * Fill a passwd struct from a nss_pack_passwd record: one copy of the
+ * strings followed by pointers relocation. A NULL homedir or shell is
+ * given by the homedir or shell setting.
+ * @param pwbuf Struct which will be filled with various info.
+ * @param buf Buffer which will contain all strings pointed to by
+ *      pwbuf.
+ * @param buflen Buffer length.
+ * @param record Packed record.
+ * @param len Record length.
+ * @param errnop Pointer to errno, will be filled if something goes wrong.
+ */
+enum nss_status fill_passwd_packed(struct passwd* pwbuf, char* buf, size_t buflen,
+                                   const unsigned char* record, size_t len, int* errnop) {
+    size_t strings = check_packed(record, len, PACKED_PASSWD_HEADER, record + 8, 3);
+    uint32_t dir = (strings != 0) ? get32(record + 20) : 0;
+    uint32_t shell = (strings != 0) ? get32(record + 24) : 0;
+    const struct nss_settings* s;
+    int res;
+
+    if(strings == 0 || (dir >= strings && dir != PACKED_NULL) || (shell >= strings && shell != PACKED_NULL)) {
+        NSS_ERROR("fill_passwd_packed: malformed record\n");
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(buflen < strings) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    memcpy(buf, record + PACKED_PASSWD_HEADER, strings);
+    pwbuf->pw_uid = get32(record);
+    pwbuf->pw_gid = get32(record + 4);
+    pwbuf->pw_name = buf + get32(record + 8);
+    pwbuf->pw_passwd = buf + get32(record + 12);
+    pwbuf->pw_gecos = buf + get32(record + 16);
+    pwbuf->pw_dir = (dir != PACKED_NULL) ? buf + dir : NULL;
+    pwbuf->pw_shell = (shell != PACKED_NULL) ? buf + shell : NULL;
+
+    buf += strings;
+    buflen -= strings;
+    s = settings_acquire();
+    res = NSS_STATUS_SUCCESS;
+    if(dir == PACKED_NULL) {
+        res = expand_packed(&pwbuf->pw_dir, s->homedir, pwbuf, &buf, &buflen, errnop);
+    }
+    if(res == NSS_STATUS_SUCCESS && shell == PACKED_NULL) {
+        res = expand_packed(&pwbuf->pw_shell, s->shell, pwbuf, &buf, &buflen, errnop);
+    }
+    settings_release(s);
+    return res;
+}
+
+/*
+ * Fill a group struct from a nss_pack_group record: members pointers
+ * area, then one copy of the strings.
+ * @param gbuf Struct which will be filled with various info.
+ * @param buf Buffer which will contain gr_mem and all strings pointed
+ *      to by gbuf.
+ * @param buflen Buffer length.
+ * @param record Packed record.
+ * @param len Record length.
+ * @param errnop Pointer to errno, will be filled if something goes wrong.
+ */
+enum nss_status fill_group_packed(struct group* gbuf, char* buf, size_t buflen,
+                                  const unsigned char* record, size_t len, int* errnop) {
+    uint32_t count = (len >= PACKED_GROUP_HEADER) ? get32(record + 4) : 0;
+    size_t header = PACKED_GROUP_HEADER + (size_t)count * 4;
+    size_t strings = 0, ptr_area_size = (count + 1) * sizeof(char*);
+    char** members = (char**)buf;
+    uint32_t i;
+
+    if(len >= PACKED_GROUP_HEADER && header < len) {
+        strings = check_packed(record, len, header, record + 8, 2);
+        if(strings != 0) {
+            strings = check_packed(record, len, header, record + PACKED_GROUP_HEADER, count);
+        }
+    }
+    if(strings == 0) {
+        NSS_ERROR("fill_group_packed: malformed record\n");
+        return NSS_STATUS_UNAVAIL;
+    }
+    if(buflen < ptr_area_size + strings) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
+    buf += ptr_area_size;
+    memcpy(buf, record + header, strings);
+    gbuf->gr_gid = get32(record);
+    gbuf->gr_name = buf + get32(record + 8);
+    gbuf->gr_passwd = buf + get32(record + 12);
+    for(i = 0 ; i < count ; ++i) {
+        members[i] = buf + get32(record + PACKED_GROUP_HEADER + i * 4);
+    }
+    members[i] = NULL;
+    if(settings_ignore_members(gbuf->gr_name)) {
+        members[0] = NULL;
+    }
+    gbuf->gr_mem = members;
+
+    return NSS_STATUS_SUCCESS;
+}
+
 /*
  * Fill an shadow password struct using given information.
  * @param spbuf Struct which will be filled with various info.
@@ -23,16 +23,61 @@
 #include <grp.h>
 #include <pwd.h>
 #include <shadow.h>
+#include <time.h>
 
-char *get_query(struct sqlite3*, char*);
+/*
+ * Queries that can be customized through the nss_queries table.
+ */
+enum nss_query {
+    QUERY_SETPWENT,
+    QUERY_GETPWNAM,
+    QUERY_GETPWUID,
+    QUERY_SETGRENT,
+    QUERY_GETGRNAM,
+    QUERY_GETGRGID,
+    QUERY_INITGROUPS,
+    QUERY_GET_USERS,
+    QUERY_SETSPENT,
+    QUERY_GETSPNAM,
+    QUERY_COUNT
+};
+
+/*
+ * Deadline of a running query, 0 ms if it has none.
+ */
+struct nss_deadline {
+    enum nss_query query;
+    int ms;
+    struct timespec expires;
+    int hit;
+};
+
+extern const char* query_names[QUERY_COUNT];
+extern const char* default_queries[QUERY_COUNT];
+
+int open_db(const char*, struct sqlite3**);
+char *get_query(struct sqlite3*, enum nss_query, int*);
+void read_query_row(struct sqlite3_stmt*, const char**, const char**, int*);
+void deadline_start(struct sqlite3*, enum nss_query, int);
+void deadline_stop(struct sqlite3*);
+void deadline_save(struct nss_deadline*);
+void deadline_restore(struct sqlite3*, const struct nss_deadline*);
+enum nss_status res2nss_status(int, struct sqlite3*, struct sqlite3_stmt*);
 
 enum nss_status fill_passwd(struct passwd*, char*, size_t, struct passwd, int*);
-inline void fill_passwd_sql(struct passwd*, struct sqlite3_stmt*);
+void fill_passwd_sql(struct passwd*, struct sqlite3_stmt*);
+enum nss_status fill_passwd_packed(struct passwd*, char*, size_t, const unsigned char*, size_t, int*);
 
 enum nss_status fill_shadow(struct spwd*, char*, size_t, struct spwd, int*);
-inline void fill_shadow_sql(struct spwd*, struct sqlite3_stmt*);
+void fill_shadow_sql(struct spwd*, struct sqlite3_stmt*);
+
+struct nss_db;
+enum nss_status fill_group(struct nss_db *, struct group *, char*, size_t, struct group, const char*, int *);
+void fill_group_sql(struct group*, const char**, struct sqlite3_stmt*);
+enum nss_status fill_group_packed(struct group*, char*, size_t, const unsigned char*, size_t, int*);
 
-enum nss_status fill_group(struct sqlite3 *, struct group *, char*, size_t, struct group, int *);
-inline void fill_group_sql(struct group*, struct sqlite3_stmt*);
+enum nss_status get_users(struct nss_db*, gid_t, char*, size_t, int*);
+enum nss_status copy_members(char**, int, char*, size_t, int*);
+enum nss_status split_members(const char*, char*, size_t, int*);
 
 #endif
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * vfs.c : Read-only SQLite VFS mapping the DB file in memory.
+ *
+ * The module never writes its DBs, so pages are served straight from a
+ * read-only mapping (xFetch) or copied from it (xRead), and the file is
+ * declared immutable: no locking, no journal lookup, no syscall at all.
+ * Writers are expected to replace the DB atomically (rename), which
+ * db_check notices. In place writes are detected with the file change
+ * counter of the DB header, the generation stamp db_check gets through
+ * NSS_FCNTL_CHANGED. DBs in WAL mode and every file but the main DB are
+ * handled by the default VFS.
+ */
+
+#include "nss-sqlite.h"
+#include "vfs.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* file change counter, incremented by each transaction writing the DB */
+#define CHANGE_COUNTER_OFFSET 24
+
+struct mmap_file {
+    sqlite3_file base;
+    int fd;
+    const unsigned char* map;
+    sqlite3_int64 size;
+    unsigned char generation[4];    /* change counter when mapped */
+};
+
+static int mmap_close(sqlite3_file* file) {
+    struct mmap_file* f = (struct mmap_file*)file;
+    munmap((void*)f->map, f->size);
+    close(f->fd);
+    return SQLITE_OK;
+}
+
+static int mmap_read(sqlite3_file* file, void* buf, int amt, sqlite3_int64 offset) {
+    struct mmap_file* f = (struct mmap_file*)file;
+
+    if(offset + amt <= f->size) {
+        memcpy(buf, f->map + offset, amt);
+        return SQLITE_OK;
+    }
+    /* SQLite expects the missing part to be zeroed */
+    memset(buf, 0, amt);
+    if(offset < f->size) {
+        memcpy(buf, f->map + offset, f->size - offset);
+    }
+    return SQLITE_IOERR_SHORT_READ;
+}
+
+static int mmap_write(sqlite3_file* file, const void* buf, int amt, sqlite3_int64 offset) {
+    return SQLITE_READONLY;
+}
+
+static int mmap_truncate(sqlite3_file* file, sqlite3_int64 size) {
+    return SQLITE_READONLY;
+}
+
+static int mmap_sync(sqlite3_file* file, int flags) {
+    return SQLITE_OK;
+}
+
+static int mmap_file_size(sqlite3_file* file, sqlite3_int64* size) {
+    *size = ((struct mmap_file*)file)->size;
+    return SQLITE_OK;
+}
+
+static int mmap_lock(sqlite3_file* file, int level) {
+    return SQLITE_OK;
+}
+
+static int mmap_unlock(sqlite3_file* file, int level) {
+    return SQLITE_OK;
+}
+
+static int mmap_check_reserved_lock(sqlite3_file* file, int* res) {
+    *res = 0;
+    return SQLITE_OK;
+}
+
+static int mmap_file_control(sqlite3_file* file, int op, void* arg) {
+    struct mmap_file* f = (struct mmap_file*)file;
+
+    if(op == NSS_FCNTL_CHANGED) {
+        *(int*)arg = memcmp(f->map + CHANGE_COUNTER_OFFSET, f->generation, 4) != 0;
+        return SQLITE_OK;
+    }
+    return SQLITE_NOTFOUND;
+}
+
+static int mmap_sector_size(sqlite3_file* file) {
+    return 4096;
+}
+
+static int mmap_device_characteristics(sqlite3_file* file) {
+    return SQLITE_IOCAP_IMMUTABLE;
+}
+
+static int mmap_fetch(sqlite3_file* file, sqlite3_int64 offset, int amt, void** pp) {
+    struct mmap_file* f = (struct mmap_file*)file;
+    *pp = (offset + amt <= f->size) ? (void*)(f->map + offset) : NULL;
+    return SQLITE_OK;
+}
+
+static int mmap_unfetch(sqlite3_file* file, sqlite3_int64 offset, void* p) {
+    return SQLITE_OK;
+}
+
+static const sqlite3_io_methods mmap_io_methods = {
+    3,
+    mmap_close,
+    mmap_read,
+    mmap_write,
+    mmap_truncate,
+    mmap_sync,
+    mmap_file_size,
+    mmap_lock,
+    mmap_unlock,
+    mmap_check_reserved_lock,
+    mmap_file_control,
+    mmap_sector_size,
+    mmap_device_characteristics,
+    NULL,                       /* xShmMap: WAL DBs aren't mapped */
+    NULL,
+    NULL,
+    NULL,
+    mmap_fetch,
+    mmap_unfetch
+};
+
+static sqlite3_vfs mmap_vfs;
+
+static int mmap_open(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* outFlags) {
+    sqlite3_vfs* parent = vfs->pAppData;
+    struct mmap_file* f = (struct mmap_file*)file;
+    struct stat st;
+    void* map;
+    int fd;
+
+    if(name == NULL || !(flags & SQLITE_OPEN_MAIN_DB) || !(flags & SQLITE_OPEN_READONLY)) {
+        return parent->xOpen(parent, name, file, flags, outFlags);
+    }
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return SQLITE_CANTOPEN;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < 100
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        /* empty or not a DB, let SQLite deal with it */
+        close(fd);
+        return parent->xOpen(parent, name, file, flags, outFlags);
+    }
+    /* WAL DBs need the shared memory index */
+    if(((const unsigned char*)map)[18] == 2 || ((const unsigned char*)map)[19] == 2) {
+        munmap(map, st.st_size);
+        close(fd);
+        return parent->xOpen(parent, name, file, flags, outFlags);
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->base.pMethods = &mmap_io_methods;
+    f->fd = fd;
+    f->map = map;
+    f->size = st.st_size;
+    memcpy(f->generation, f->map + CHANGE_COUNTER_OFFSET, 4);
+    if(outFlags != NULL) {
+        *outFlags = SQLITE_OPEN_READONLY;
+    }
+    return SQLITE_OK;
+}
+
+static pthread_once_t mmap_vfs_once = PTHREAD_ONCE_INIT;
+static int mmap_vfs_registered = FALSE;
+
+static void mmap_vfs_register(void) {
+    sqlite3_vfs* parent = sqlite3_vfs_find(NULL);
+
+    if(parent == NULL) {
+        return;
+    }
+    mmap_vfs = *parent;
+    mmap_vfs.pNext = NULL;
+    mmap_vfs.zName = NSS_SQLITE_MMAP_VFS_NAME;
+    mmap_vfs.pAppData = parent;
+    if(mmap_vfs.szOsFile < sizeof(struct mmap_file)) {
+        mmap_vfs.szOsFile = sizeof(struct mmap_file);
+    }
+    mmap_vfs.xOpen = mmap_open;
+    if(sqlite3_vfs_register(&mmap_vfs, 0) != SQLITE_OK) {
+        NSS_ERROR("Unable to register the %s VFS\n", NSS_SQLITE_MMAP_VFS_NAME);
+        return;
+    }
+    mmap_vfs_registered = TRUE;
+}
+
+/*
+ * Register the VFS the first time it's needed.
+ * @return VFS name to give sqlite3_open_v2, NULL if unavailable.
+ */
+const char* mmap_vfs_name(void) {
+    pthread_once(&mmap_vfs_once, mmap_vfs_register);
+    return mmap_vfs_registered ? NSS_SQLITE_MMAP_VFS_NAME : NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NSS_SQLITE_VFS_H
+#define NSS_SQLITE_VFS_H
+
+#define NSS_SQLITE_MMAP_VFS_NAME "nss-mmap"
+#define NSS_SQLITE_ZSTD_VFS_NAME "nss-zstd"
+
+/*
+ * File control telling (int*) if the DB was written in place since it was
+ * mapped. Left unhandled (SQLITE_NOTFOUND) by other VFS.
+ */
+#define NSS_FCNTL_CHANGED 0x4e535301
+
+/*
+ * Read-only VFS serving the DB from a memory mapping, see vfs.c.
+ */
+const char* mmap_vfs_name(void);
+
+/*
+ * Page compressed DBs written by nss-sqlite-pack. All integers are little
+ * endian:
+ *  - header: magic, page size (4 bytes), pages per group (4 bytes),
+ *    size of the DB once uncompressed (8 bytes), group count (4 bytes)
+ *    and 4 unused bytes,
+ *  - offset index: group count + 1 file offsets (8 bytes each), group i
+ *    being stored between offsets i and i + 1,
+ *  - groups: each one a zstd frame holding consecutive DB pages.
+ */
+#define ZSTD_PACK_MAGIC "NSSZSTD1"
+#define ZSTD_PACK_HEADER 32
+
+/*
+ * Read-only VFS serving DBs packed by nss-sqlite-pack, see zvfs.c.
+ */
+const char* zstd_vfs_name(void);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2007, Sébastien Le Ray
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * zvfs.c : Read-only SQLite VFS for page compressed DBs.
+ *
+ * nss-sqlite-pack compresses a DB by groups of pages with zstd and writes
+ * an offset index in front of them (see vfs.h). Less data is then read
+ * from the disk and the page cache of the OS holds more of the directory.
+ * Reads decompress the group holding the requested page, the last group
+ * decompressed being kept for the next pages. Files not starting with the
+ * magic are handled by the parent VFS (the mmap VFS if enabled), so plain
+ * DBs keep on working.
+ */
+
+#include "nss-sqlite.h"
+#include "vfs.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+struct zstd_file {
+    sqlite3_file base;
+    int fd;
+    sqlite3_int64 size;         /* uncompressed DB size */
+    sqlite3_int64 group_size;   /* uncompressed bytes per group */
+    unsigned int groups;
+    sqlite3_uint64* index;      /* groups + 1 frame offsets */
+    ZSTD_DCtx* dctx;
+    void* frame;                /* compressed group */
+    unsigned char* data;        /* uncompressed group */
+    long current;               /* group in data, -1 if none */
+};
+
+static unsigned int get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static sqlite3_uint64 get_le64(const unsigned char* p) {
+    return get_le32(p) | ((sqlite3_uint64)get_le32(p + 4) << 32);
+}
+
+static int zstd_close(sqlite3_file* file) {
+    struct zstd_file* f = (struct zstd_file*)file;
+    ZSTD_freeDCtx(f->dctx);
+    free(f->index);
+    free(f->frame);
+    free(f->data);
+    close(f->fd);
+    return SQLITE_OK;
+}
+
+/*
+ * Make the group data the uncompressed group i.
+ */
+static int zstd_load(struct zstd_file* f, long i) {
+    size_t len = f->index[i + 1] - f->index[i];
+    sqlite3_int64 expected = f->size - i * f->group_size;
+    size_t res;
+
+    if(f->current == i) {
+        return SQLITE_OK;
+    }
+    if(expected > f->group_size) {
+        expected = f->group_size;
+    }
+    f->current = -1;
+    if(pread(f->fd, f->frame, len, f->index[i]) != (ssize_t)len) {
+        return SQLITE_IOERR_READ;
+    }
+    res = ZSTD_decompressDCtx(f->dctx, f->data, f->group_size, f->frame, len);
+    if(ZSTD_isError(res) || res != (size_t)expected) {
+        NSS_ERROR("Corrupted compressed group %ld: %s\n", i,
+                ZSTD_isError(res) ? ZSTD_getErrorName(res) : "bad size");
+        return SQLITE_CORRUPT;
+    }
+    f->current = i;
+    return SQLITE_OK;
+}
+
+static int zstd_read(sqlite3_file* file, void* buf, int amt, sqlite3_int64 offset) {
+    struct zstd_file* f = (struct zstd_file*)file;
+    unsigned char* out = buf;
+    int res;
+
+    while(amt > 0) {
+        long i = offset / f->group_size;
+        sqlite3_int64 start = offset - i * f->group_size;
+        sqlite3_int64 n = f->group_size - start;
+
+        if(offset >= f->size) {
+            /* SQLite expects the missing part to be zeroed */
+            memset(out, 0, amt);
+            return SQLITE_IOERR_SHORT_READ;
+        }
+        if((res = zstd_load(f, i)) != SQLITE_OK) {
+            return res;
+        }
+        if(n > f->size - offset) {
+            n = f->size - offset;
+        }
+        if(n > amt) {
+            n = amt;
+        }
+        memcpy(out, f->data + start, n);
+        out += n;
+        offset += n;
+        amt -= n;
+    }
+    return SQLITE_OK;
+}
+
+static int zstd_write(sqlite3_file* file, const void* buf, int amt, sqlite3_int64 offset) {
+    return SQLITE_READONLY;
+}
+
+static int zstd_truncate(sqlite3_file* file, sqlite3_int64 size) {
+    return SQLITE_READONLY;
+}
+
+static int zstd_sync(sqlite3_file* file, int flags) {
+    return SQLITE_OK;
+}
+
+static int zstd_file_size(sqlite3_file* file, sqlite3_int64* size) {
+    *size = ((struct zstd_file*)file)->size;
+    return SQLITE_OK;
+}
+
+static int zstd_lock(sqlite3_file* file, int level) {
+    return SQLITE_OK;
+}
+
+static int zstd_unlock(sqlite3_file* file, int level) {
+    return SQLITE_OK;
+}
+
+static int zstd_check_reserved_lock(sqlite3_file* file, int* res) {
+    *res = 0;
+    return SQLITE_OK;
+}
+
+static int zstd_file_control(sqlite3_file* file, int op, void* arg) {
+    return SQLITE_NOTFOUND;
+}
+
+static int zstd_sector_size(sqlite3_file* file) {
+    return 4096;
+}
+
+static int zstd_device_characteristics(sqlite3_file* file) {
+    return SQLITE_IOCAP_IMMUTABLE;
+}
+
+static const sqlite3_io_methods zstd_io_methods = {
+    1,
+    zstd_close,
+    zstd_read,
+    zstd_write,
+    zstd_truncate,
+    zstd_sync,
+    zstd_file_size,
+    zstd_lock,
+    zstd_unlock,
+    zstd_check_reserved_lock,
+    zstd_file_control,
+    zstd_sector_size,
+    zstd_device_characteristics
+};
+
+/*
+ * Read and check the header and offset index of a packed DB.
+ * @return SQLITE_OK, SQLITE_NOTFOUND if fd isn't a packed DB, an error
+ * code otherwise.
+ */
+static int zstd_read_index(struct zstd_file* f) {
+    unsigned char header[ZSTD_PACK_HEADER];
+    unsigned char* raw;
+    unsigned int page_size, group_pages, i;
+    size_t frame_max = 0, index_size;
+    struct stat st;
+
+    if(fstat(f->fd, &st) != 0 || pread(f->fd, header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header, ZSTD_PACK_MAGIC, 8) != 0) {
+        return SQLITE_NOTFOUND;
+    }
+    page_size = get_le32(header + 8);
+    group_pages = get_le32(header + 12);
+    f->size = get_le64(header + 16);
+    f->groups = get_le32(header + 24);
+    f->group_size = (sqlite3_int64)page_size * group_pages;
+    /* groups * group_size can't overflow, being less than 2^60 */
+    if(page_size < 512 || page_size > 65536 || group_pages == 0 || group_pages > 4096 || f->size < 0
+            || f->groups * f->group_size < f->size
+            || (f->groups > 0 && (f->groups - 1) * f->group_size >= f->size)) {
+        return SQLITE_CORRUPT;
+    }
+    /* the index must fit in the file, and its size in a size_t */
+    if(f->groups >= SIZE_MAX / sizeof(*f->index) - 1
+            || f->groups >= (st.st_size - ZSTD_PACK_HEADER) / 8) {
+        return SQLITE_CORRUPT;
+    }
+    index_size = ((size_t)f->groups + 1) * 8;
+
+    raw = malloc(index_size);
+    f->index = malloc(((size_t)f->groups + 1) * sizeof(*f->index));
+    if(raw == NULL || f->index == NULL) {
+        free(raw);
+        return SQLITE_NOMEM;
+    }
+    if(pread(f->fd, raw, index_size, ZSTD_PACK_HEADER) != (ssize_t)index_size) {
+        free(raw);
+        return SQLITE_CORRUPT;
+    }
+    for(i = 0 ; i <= f->groups ; ++i) {
+        f->index[i] = get_le64(raw + (size_t)i * 8);
+    }
+    free(raw);
+
+    if(f->index[0] < ZSTD_PACK_HEADER + index_size || f->index[f->groups] > st.st_size) {
+        return SQLITE_CORRUPT;
+    }
+    for(i = 0 ; i < f->groups ; ++i) {
+        if(f->index[i + 1] < f->index[i]) {
+            return SQLITE_CORRUPT;
+        }
+        if(f->index[i + 1] - f->index[i] > frame_max) {
+            frame_max = f->index[i + 1] - f->index[i];
+        }
+    }
+
+    f->frame = malloc(frame_max > 0 ? frame_max : 1);
+    f->data = malloc(f->group_size);
+    f->dctx = ZSTD_createDCtx();
+    if(f->frame == NULL || f->data == NULL || f->dctx == NULL) {
+        return SQLITE_NOMEM;
+    }
+    f->current = -1;
+    return SQLITE_OK;
+}
+
+static sqlite3_vfs zstd_vfs;
+
+static int zstd_open(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* outFlags) {
+    sqlite3_vfs* parent = vfs->pAppData;
+    struct zstd_file* f = (struct zstd_file*)file;
+    int res;
+
+    if(name == NULL || !(flags & SQLITE_OPEN_MAIN_DB) || !(flags & SQLITE_OPEN_READONLY)) {
+        return parent->xOpen(parent, name, file, flags, outFlags);
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(f->fd < 0) {
+        return SQLITE_CANTOPEN;
+    }
+    res = zstd_read_index(f);
+    if(res != SQLITE_OK) {
+        ZSTD_freeDCtx(f->dctx);
+        free(f->index);
+        free(f->frame);
+        free(f->data);
+        close(f->fd);
+        if(res == SQLITE_NOTFOUND) {
+            /* plain DB */
+            return parent->xOpen(parent, name, file, flags, outFlags);
+        }
+        NSS_ERROR("%s isn't a valid packed DB\n", name);
+        return res;
+    }
+
+    f->base.pMethods = &zstd_io_methods;
+    if(outFlags != NULL) {
+        *outFlags = SQLITE_OPEN_READONLY;
+    }
+    return SQLITE_OK;
+}
+
+static pthread_once_t zstd_vfs_once = PTHREAD_ONCE_INIT;
+static int zstd_vfs_registered = FALSE;
+
+static void zstd_vfs_register(void) {
+#ifdef NSS_SQLITE_MMAP_VFS
+    sqlite3_vfs* parent = sqlite3_vfs_find(mmap_vfs_name());
+#else
+    sqlite3_vfs* parent = sqlite3_vfs_find(NULL);
+#endif
+
+    if(parent == NULL) {
+        return;
+    }
+    zstd_vfs = *parent;
+    zstd_vfs.pNext = NULL;
+    zstd_vfs.zName = NSS_SQLITE_ZSTD_VFS_NAME;
+    zstd_vfs.pAppData = parent;
+    if(zstd_vfs.szOsFile < sizeof(struct zstd_file)) {
+        zstd_vfs.szOsFile = sizeof(struct zstd_file);
+    }
+    zstd_vfs.xOpen = zstd_open;
+    if(sqlite3_vfs_register(&zstd_vfs, 0) != SQLITE_OK) {
+        NSS_ERROR("Unable to register the %s VFS\n", NSS_SQLITE_ZSTD_VFS_NAME);
+        return;
+    }
+    zstd_vfs_registered = TRUE;
+}
+
+/*
+ * Register the VFS the first time it's needed.
+ * @return VFS name to give sqlite3_open_v2, NULL if unavailable.
+ */
+const char* zstd_vfs_name(void) {
+    pthread_once(&zstd_vfs_once, zstd_vfs_register);
+    return zstd_vfs_registered ? NSS_SQLITE_ZSTD_VFS_NAME : NULL;
+}